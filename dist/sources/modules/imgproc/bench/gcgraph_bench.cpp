@@ -0,0 +1,371 @@
+/*M///////////////////////////////////////////////////////////////////////////////////////
+//
+//  IMPORTANT: READ BEFORE DOWNLOADING, COPYING, INSTALLING OR USING.
+//
+//  By downloading, copying, installing or using the software you agree to this license.
+//  If you do not agree to this license, do not download, install,
+//  copy or use the software.
+//
+//
+//                        Intel License Agreement
+//                For Open Source Computer Vision Library
+//
+// Copyright (C) 2000, Intel Corporation, all rights reserved.
+// Third party copyrights are property of their respective owners.
+//
+// Redistribution and use in source and binary forms, with or without modification,
+// are permitted provided that the following conditions are met:
+//
+//   * Redistribution's of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//   * Redistribution's in binary form must reproduce the above copyright notice,
+//     this list of conditions and the following disclaimer in the documentation
+//     and/or other materials provided with the distribution.
+//
+//   * The name of Intel Corporation may not be used to endorse or promote products
+//     derived from this software without specific prior written permission.
+//
+// This software is provided by the copyright holders and contributors "as is" and
+// any express or implied warranties, including, but not limited to, the implied
+// warranties of merchantability and fitness for a particular purpose are disclaimed.
+// In no event shall the Intel Corporation or contributors be liable for any direct,
+// indirect, incidental, special, exemplary, or consequential damages
+// (including, but not limited to, procurement of substitute goods or services;
+// loss of use, data, or profits; or business interruption) however caused
+// and on any theory of liability, whether in contract, strict liability,
+// or tort (including negligence or otherwise) arising in any way out of
+// the use of this software, even if advised of the possibility of such damage.
+//
+//M*/
+
+/*
+ Standalone benchmark of GCGraph::maxFlow on 8-connected grid graphs, the ones of grabCut: the
+ t-weights favor the source inside an ellipse and the sink outside, and the n-weights are random.
+
+ Build, from this directory:
+   g++ -O2 -std=c++11 -I../src gcgraph_bench.cpp -lopencv_core -pthread -o gcgraph_bench
+
+ Usage: gcgraph_bench width height [reps [regions [hugepages [placement]]]]
+ regions solves region-parallel first (8x8 then 7x7 regions, as grabCut), hugepages builds the
+ graphs on an arena backed by huge pages. The graph is built again for each rep, on the same
+ arena, and the best time of maxFlow is reported.
+ placement is the NUMA placement of the graph (Linux): first (the default) leaves the pages on
+ the node of the thread which touches them first, interleave spreads them page by page over the
+ nodes (MPOL_INTERLEAVE), and nodes splits the arrays in one part per node, as grabCut does (see
+ GCGraphArena::setNodes). With interleave and nodes, the threads of the regions are pinned to the
+ nodes, each one solving the regions of its node first, those of the bands of rows placed on it
+ by nodes. On a machine with a single node, the placement has no effect.
+ On Linux, the hardware counters (cycles, instructions, cache misses, branch misses, dTLB read
+ misses) and the minor page faults of the build and of maxFlow are read from perf_event_open, -1
+ standing for a counter which is not available. The faults of the build are those the arena and
+ the huge pages save, e.g. on the 24 MP graphs of a 6000x4000 image. The counters include the
+ threads of the regions (inherit).
+*/
+
+#include <opencv2/core.hpp>
+#include "gcgraph.hpp"
+#include <atomic>
+#include <cfloat>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+#if defined __linux__
+#include <linux/mempolicy.h>
+#include <linux/perf_event.h>
+#include <sched.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+using namespace cv;
+
+namespace
+{
+
+struct Counters
+{
+	static const int count = 6;
+	int fds[count];
+	long long values[count];
+
+	Counters()
+	{
+#if defined __linux__
+		const unsigned types[count] = { PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE,
+			PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE, PERF_TYPE_SOFTWARE };
+		const unsigned long long configs[count] = { PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+			PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES,
+			PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+			PERF_COUNT_SW_PAGE_FAULTS_MIN };
+		for (int k = 0; k < count; k++)
+		{
+			perf_event_attr a;
+			memset(&a, 0, sizeof(a));
+			a.size = sizeof(a);
+			a.type = types[k];
+			a.config = configs[k];
+			a.disabled = 1;
+			// the threads created while counting are counted once joined
+			a.inherit = 1;
+			a.exclude_kernel = 1;
+			a.exclude_hv = 1;
+			fds[k] = (int)syscall(__NR_perf_event_open, &a, 0, -1, -1, 0);
+		}
+#else
+		for (int k = 0; k < count; k++)
+			fds[k] = -1;
+#endif
+	}
+
+	void start()
+	{
+#if defined __linux__
+		for (int k = 0; k < count; k++)
+			if (fds[k] >= 0)
+			{
+				ioctl(fds[k], PERF_EVENT_IOC_RESET, 0);
+				ioctl(fds[k], PERF_EVENT_IOC_ENABLE, 0);
+			}
+#endif
+	}
+
+	// -1 for the counters which are not available
+	void stop()
+	{
+		for (int k = 0; k < count; k++)
+		{
+			values[k] = -1;
+#if defined __linux__
+			if (fds[k] >= 0)
+			{
+				ioctl(fds[k], PERF_EVENT_IOC_DISABLE, 0);
+				if (read(fds[k], &values[k], sizeof(values[k])) != sizeof(values[k]))
+					values[k] = -1;
+			}
+#endif
+		}
+	}
+
+	void print(const char* phase, double seconds) const
+	{
+		printf("%s %.3fs cycles %lld instructions %lld cache-misses %lld branch-misses %lld "
+			"dTLB-load-misses %lld page-faults %lld\n", phase, seconds, values[0], values[1], values[2],
+			values[3], values[4], values[5]);
+	}
+
+	~Counters()
+	{
+#if defined __linux__
+		for (int k = 0; k < count; k++)
+			if (fds[k] >= 0)
+				close(fds[k]);
+#endif
+	}
+};
+
+void buildGrid(GCGraph<double>& g, int w, int h)
+{
+	RNG rng(7);
+	g.create((size_t)w * h, (size_t)w * h * 8);
+	for (int y = 0; y < h; y++)
+		for (int x = 0; x < w; x++)
+			g.addVtx((y / (h / 8 + 1)) * 8 + x / (w / 8 + 1), (y / (h / 7 + 1)) * 8 + x / (w / 7 + 1));
+	for (int y = 0; y < h; y++)
+		for (int x = 0; x < w; x++)
+		{
+			int i = y * w + x;
+			double dx = (x - w * 0.5) / (w * 0.3), dy = (y - h * 0.5) / (h * 0.3);
+			double s = rng.uniform(0, 100) * 0.1, t = rng.uniform(0, 100) * 0.1;
+			if (dx * dx + dy * dy < 1)
+				s += 3;
+			else
+				t += 3;
+			g.addTermWeights(i, s, t);
+			double nw = 5 + rng.uniform(0, 50);
+			if (x > 0)
+				g.addEdges(i, i - 1, nw, nw);
+			if (y > 0)
+				g.addEdges(i, i - w, nw, nw);
+			if (x > 0 && y > 0)
+				g.addEdges(i, i - w - 1, nw * 0.7, nw * 0.7);
+			if (x < w - 1 && y > 0)
+				g.addEdges(i, i - w + 1, nw * 0.7, nw * 0.7);
+		}
+}
+
+/*
+ NUMA nodes of the machine with their CPUs, empty when it has a single node
+*/
+struct NumaNode
+{
+	int id;
+	std::vector<int> cpus;
+};
+
+std::vector<NumaNode> numaNodes()
+{
+	std::vector<NumaNode> nodes;
+#if defined __linux__
+	for (int id = 0; id < 1024; id++)
+	{
+		char path[64];
+		sprintf(path, "/sys/devices/system/node/node%d/cpulist", id);
+		FILE* f = fopen(path, "r");
+		if (!f)
+			continue;
+		// list of ranges, e.g. 0-7,16-23
+		NumaNode node;
+		node.id = id;
+		int first, last, c = ',';
+		while (c == ',' && fscanf(f, "%d", &first) == 1)
+		{
+			last = first;
+			if ((c = fgetc(f)) == '-' && fscanf(f, "%d", &last) == 1)
+				c = fgetc(f);
+			for (int cpu = first; cpu <= last; cpu++)
+				node.cpus.push_back(cpu);
+		}
+		fclose(f);
+		if (!node.cpus.empty())
+			nodes.push_back(node);
+	}
+#endif
+	if (nodes.size() < 2)
+		nodes.clear();
+	return nodes;
+}
+
+/*
+ Interleaves the pages the calling thread allocates next over the nodes
+*/
+void interleave(const std::vector<NumaNode>& nodes)
+{
+#if defined __linux__
+	const size_t bits = 8 * sizeof(unsigned long);
+	std::vector<unsigned long> mask(nodes.back().id / bits + 1);
+	for (size_t k = 0; k < nodes.size(); k++)
+		mask[nodes[k].id / bits] |= 1ul << (nodes[k].id % bits);
+	if (syscall(__NR_set_mempolicy, MPOL_INTERLEAVE, mask.data(), mask.size() * bits + 1) != 0)
+		printf("set_mempolicy failed, the placement is the default one\n");
+#else
+	(void)nodes;
+#endif
+}
+
+/*
+ Region-parallel pass of grabCut on all the threads. With nodes, the threads are spread over the
+ nodes and pinned to them, and the regions are split in bands of rows, one per node, as the
+ arrays of a graph placed by GCGraphArena::setNodes: the threads of a node solve the regions of
+ its band, then help the other nodes.
+*/
+void regionsMaxFlow(GCGraph<double>& g, const std::vector<NumaNode>& nodes)
+{
+	g.finalize();
+	int threadCount = std::max(1, (int)std::thread::hardware_concurrency());
+	int nodeCount = std::max(1, (int)nodes.size());
+	for (int f = 0; f < 2; f++)
+	{
+		int bands = f ? 7 : 8;
+		std::vector<std::vector<int> > regions(nodeCount);
+		for (int reg = 0; reg < 64; reg++)
+			regions[std::min(reg / 8 * nodeCount / bands, nodeCount - 1)].push_back(reg);
+		std::vector<std::atomic<int> > next(nodeCount);
+		for (int n = 0; n < nodeCount; n++)
+			next[n] = 0;
+
+		std::vector<std::thread> threads;
+		for (int k = 0; k < threadCount; k++)
+			threads.push_back(std::thread([&, k, f]
+			{
+				int home = k * nodeCount / threadCount;
+#if defined __linux__
+				if (!nodes.empty())
+				{
+					cpu_set_t cpus;
+					CPU_ZERO(&cpus);
+					for (size_t c = 0; c < nodes[home].cpus.size(); c++)
+						if (nodes[home].cpus[c] < CPU_SETSIZE)
+							CPU_SET(nodes[home].cpus[c], &cpus);
+					sched_setaffinity(0, sizeof(cpus), &cpus);
+				}
+#endif
+				for (int d = 0; d < nodeCount; d++)
+				{
+					int n = (home + d) % nodeCount;
+					for (int i; (i = next[n]++) < (int)regions[n].size();)
+						g.maxFlow(regions[n][i], f);
+				}
+			}));
+		for (size_t k = 0; k < threads.size(); k++)
+			threads[k].join();
+	}
+}
+
+double now()
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+}
+
+int main(int argc, char** argv)
+{
+	if (argc < 3)
+	{
+		printf("usage: %s width height [reps [regions [hugepages [first|interleave|nodes]]]]\n", argv[0]);
+		return 1;
+	}
+	int w = atoi(argv[1]), h = atoi(argv[2]), reps = argc > 3 ? atoi(argv[3]) : 3;
+	bool regions = argc > 4 && atoi(argv[4]) != 0, hugePages = argc > 5 && atoi(argv[5]) != 0;
+	std::string placement = argc > 6 ? argv[6] : "first";
+	if (placement != "first" && placement != "interleave" && placement != "nodes")
+	{
+		printf("unknown placement %s\n", placement.c_str());
+		return 1;
+	}
+
+	GCGraphArena arena(hugePages);
+	std::vector<NumaNode> nodes;
+	if (placement != "first")
+	{
+		nodes = numaNodes();
+		if (nodes.empty())
+			printf("single NUMA node, the placement has no effect\n");
+	}
+	if (placement == "interleave" && !nodes.empty())
+		interleave(nodes);
+	if (placement == "nodes" && !nodes.empty())
+	{
+		std::vector<int> ids;
+		for (size_t k = 0; k < nodes.size(); k++)
+			ids.push_back(nodes[k].id);
+		arena.setNodes(ids);
+	}
+	Counters counters;
+	double best = DBL_MAX, flow = 0;
+	for (int r = 0; r < reps; r++)
+	{
+		GCGraph<double> g(&arena);
+		double t0 = now();
+		counters.start();
+		buildGrid(g, w, h);
+		counters.stop();
+		double t1 = now();
+		counters.print("build", t1 - t0);
+		counters.start();
+		if (regions)
+			regionsMaxFlow(g, nodes);
+		flow = g.maxFlow();
+		counters.stop();
+		double t2 = now();
+		counters.print("maxFlow", t2 - t1);
+		best = std::min(best, t2 - t1);
+	}
+	printf("flow %.6f best %.3fs\n", flow, best);
+	return 0;
+}
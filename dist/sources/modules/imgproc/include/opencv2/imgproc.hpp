@@ -366,7 +366,12 @@ enum GrabCutModes {
     automatically initialized with GC_BGD .*/
     GC_INIT_WITH_MASK  = 1,
     /** The value means that the algorithm should just resume. */
-    GC_EVAL            = 2
+    GC_EVAL            = 2,
+    /** Flag which can be combined with the values above. The algorithm only processes the
+    bounding box of the GC_PR_BGD and GC_PR_FGD pixels, with a ring of one pixel, the GMMs being
+    learned from a sample of the pixels outside of it. The cost then depends on the size of the
+    object rather than on the size of the image. */
+    GC_ROI_ONLY        = 8
 };
 
 //! distanceTransform algorithm flags
@@ -3093,6 +3098,116 @@ CV_EXPORTS_W void pyrMeanShiftFiltering( InputArray src, OutputArray dst,
 An example using the GrabCut algorithm
  */
 
+/** @brief Statistics of a call of the GrabCut algorithm.
+
+The vectors hold one value per iteration of the algorithm.
+ */
+struct CV_EXPORTS GrabCutStats
+{
+    GrabCutStats() : iterations(0), energy(0) {}
+
+    //! number of iterations run, see GrabCutParams::termCrit
+    int iterations;
+    //! energy of the final segmentation (data term of the possible background or foreground
+    //! pixels, and smoothness term), for the final GMMs
+    double energy;
+    //! number of vertices of the graph handed to the max flow computation
+    std::vector<int> vtxCount;
+    //! number of possible background or foreground pixels removed from the graph before the max
+    //! flow computation, as their label is fixed by the persistency test
+    std::vector<int> eliminatedVtxCount;
+    //! 1 when the iteration was run on a narrow band (see GrabCutParams::bandWidth) and the
+    //! boundary of the segmentation reached the edge of the band, so the whole image was solved
+    std::vector<int> bandOverflow;
+    //! number of possible background or foreground pixels frozen before the iteration, see
+    //! GrabCutParams::freezeIterations
+    std::vector<int> frozenCount;
+};
+
+/** @brief Parameters of the GrabCut algorithm.
+ */
+struct CV_EXPORTS GrabCutParams
+{
+    GrabCutParams();
+
+    //! When positive, the iterations after the first one only solve the possible background or
+    //! foreground pixels closer than bandWidth to the boundary of the current segmentation, the
+    //! other ones keeping their label. If the new boundary reaches the edge of the band, the
+    //! whole image is solved.
+    int bandWidth;
+
+    //! When positive, the iterations run on the image downsampled pyramidLevels times (each time
+    //! by 2). The mask is then upsampled, and one more iteration is run at full resolution on the
+    //! pixels close to the boundary: bandWidth pixels, or 2^(pyramidLevels+1) if bandWidth is 0.
+    //! The other possible background or foreground pixels keep their upsampled label.
+    int pyramidLevels;
+
+    //! When greater than 1, the iterations run on a graph whose vertices are superpixels of about
+    //! superpixelSize x superpixelSize pixels (SLIC clustering of the possible background or
+    //! foreground pixels in the color space of the image). One more iteration is then run at full
+    //! resolution on the pixels close to the boundary: bandWidth pixels, or superpixelSize if
+    //! bandWidth is 0. pyramidLevels is then ignored.
+    int superpixelSize;
+
+    //! Termination criteria of the iterations. With TermCriteria::COUNT, at most maxCount
+    //! iterations are run (and at most iterCount). With TermCriteria::EPS, the iterations stop
+    //! when the relative change of the energy, or the fraction of the possible background or
+    //! foreground pixels whose label changed, is not greater than epsilon. The default
+    //! TermCriteria() runs iterCount iterations.
+    TermCriteria termCrit;
+
+    //! When positive, a possible background or foreground pixel which kept its label for
+    //! freezeIterations consecutive iterations, and whose data term favors this label by at least
+    //! freezeMargin (difference of the negative log-likelihoods of the GMMs), is frozen: it is
+    //! handled as a background or foreground pixel by the next iterations, which solve smaller
+    //! graphs. The frozen pixels get back their possible class when the function returns.
+    int freezeIterations;
+    double freezeMargin;
+
+    //! When true, the residual capacities of the graph edges are stored as 16-bit integers instead
+    //! of doubles, in units of gamma/32767 (the t-weights being rounded to the same unit), which
+    //! reduces the memory of the edges by a quarter. The labels may differ from the exact solution
+    //! on pixels whose costs differ by less than the rounding. Ignored for the images whose graph
+    //! needs 64-bit indices.
+    bool quantizeCapacities;
+
+    //! Neighborhood of the pixels in the graph: 8 (the default) links each pixel to its
+    //! horizontal, vertical and diagonal neighbors, 4 only to the horizontal and vertical ones.
+    //! The 4-connectivity halves the number of edges, which makes the iterations faster, the
+    //! boundaries of the segmentation being slightly blockier.
+    int connectivity;
+};
+
+/** @brief Buffers of the GrabCut algorithm, reused by the calls it is given to.
+
+The workspace keeps the graph and the per-pixel matrices of the iterations, sized for the largest
+image segmented so far, so that the successive calls do not allocate them again. A workspace must
+not be used by concurrent calls.
+ */
+class CV_EXPORTS GrabCutWorkspace : public Algorithm
+{
+public:
+    //! frees the buffers
+    virtual void release() = 0;
+    //! memory held by the buffers, in bytes
+    virtual size_t memoryUsage() const = 0;
+};
+
+/** @brief Creates an empty GrabCut workspace.
+
+@param hugePages Back the graph and the buffers with transparent huge pages, where the system
+supports them. This reduces the TLB misses of the max flow on large images.
+@param storageDir Directory of the files holding the buffers past memoryLimit, for images whose
+graph does not fit in memory. The files are removed when created and live as long as their
+mapping. When empty, everything is kept in memory.
+@param memoryLimit Memory, in bytes, the buffers may take before going to files of storageDir.
+Only the regions being solved are then resident, so the limit should leave room for the pages
+read ahead by the threads of the max flow.
+ */
+CV_EXPORTS Ptr<GrabCutWorkspace> createGrabCutWorkspace( bool hugePages = false,
+                                                         const String& storageDir = String(),
+                                                         size_t memoryLimit = 0 );
+
 /** @brief Runs the GrabCut algorithm.
 
 The function implements the [GrabCut image segmentation algorithm](http://en.wikipedia.org/wiki/GrabCut).
@@ -3115,6 +3230,56 @@ CV_EXPORTS_W void grabCut( InputArray img, InputOutputArray mask, Rect rect,
                            InputOutputArray bgdModel, InputOutputArray fgdModel,
                            int iterCount, int mode = GC_EVAL );
 
+/** @overload
+@param stats Optional output statistics of the call, see cv::GrabCutStats.
+ */
+CV_EXPORTS void grabCut( InputArray img, InputOutputArray mask, Rect rect,
+                         InputOutputArray bgdModel, InputOutputArray fgdModel,
+                         int iterCount, int mode, GrabCutStats* stats );
+
+/** @overload
+@param params Parameters of the algorithm, see cv::GrabCutParams.
+@param stats Optional output statistics of the call, see cv::GrabCutStats.
+ */
+CV_EXPORTS void grabCut( InputArray img, InputOutputArray mask, Rect rect,
+                         InputOutputArray bgdModel, InputOutputArray fgdModel,
+                         int iterCount, int mode, const GrabCutParams& params,
+                         GrabCutStats* stats = 0 );
+
+/** @overload
+@param params Parameters of the algorithm, see cv::GrabCutParams.
+@param workspace Buffers reused from a call to the next one, see cv::GrabCutWorkspace. May be
+empty.
+@param stats Optional output statistics of the call, see cv::GrabCutStats.
+ */
+CV_EXPORTS void grabCut( InputArray img, InputOutputArray mask, Rect rect,
+                         InputOutputArray bgdModel, InputOutputArray fgdModel,
+                         int iterCount, int mode, const GrabCutParams& params,
+                         const Ptr<GrabCutWorkspace>& workspace, GrabCutStats* stats = 0 );
+
+/** @brief Runs the GrabCut algorithm on a batch of images.
+
+The images are segmented on a thread pool shared by all the calls of the process: the small
+images are segmented in parallel, one image per thread, and the large ones one after another,
+each of them using all the threads. The arguments are those of cv::grabCut, for each image.
+
+@param imgs Input 8-bit 3-channel images.
+@param masks Input/output masks, one per image.
+@param rects ROIs containing the segmented objects, one per image. Only used when mode is
+GC_INIT_WITH_RECT, may be empty otherwise.
+@param bgdModels Background models, resized to the number of images.
+@param fgdModels Foreground models, resized to the number of images.
+@param iterCount Number of iterations.
+@param mode Operation mode that could be one of the cv::GrabCutModes
+@param params Parameters of the algorithm, see cv::GrabCutParams.
+@param stats Optional output statistics, one per image, see cv::GrabCutStats.
+ */
+CV_EXPORTS void grabCutBatch( const std::vector<Mat>& imgs, std::vector<Mat>& masks,
+                              const std::vector<Rect>& rects,
+                              std::vector<Mat>& bgdModels, std::vector<Mat>& fgdModels,
+                              int iterCount, int mode, const GrabCutParams& params = GrabCutParams(),
+                              std::vector<GrabCutStats>* stats = 0 );
+
 /* Added by BV
 * export slim version 
 * of the grabcut algorithm
@@ -3122,8 +3287,166 @@ CV_EXPORTS_W void grabCut( InputArray img, InputOutputArray mask, Rect rect,
 CV_EXPORTS_W void grabCut_slim( InputArray img, InputOutputArray mask, Rect rect,
                                InputOutputArray bgdModel, InputOutputArray fgdModel,
                                int iterCount, int mode = GC_EVAL );
+
+CV_EXPORTS void grabCut_slim( InputArray img, InputOutputArray mask, Rect rect,
+                              InputOutputArray bgdModel, InputOutputArray fgdModel,
+                              int iterCount, int mode, GrabCutStats* stats );
 /* End of addition*/
 
+/** @brief Interactive GrabCut segmentation of an image.
+
+The session keeps the state computed from the image (n-weights), the GMMs, the graph and its
+residual flow between calls. After a user stroke, only the t-weights of the changed pixels are
+updated and the max flow is resumed from the previous one, instead of running grabCut with
+mode==GC_EVAL on the whole image.
+
+The GMMs are not learned again after a stroke: call run to learn them from the current mask and
+segment the image again. A stroke applied before the first call of run only modifies the mask.
+ */
+class CV_EXPORTS GrabCutSession : public Algorithm
+{
+public:
+    /** @brief Runs iterCount iterations of the GrabCut algorithm, GMMs learning included, on the
+    current mask.
+    */
+    virtual void run( int iterCount ) = 0;
+
+    /** @brief Marks the pixels of a mask patch and updates the segmentation.
+
+    @param patch 8-bit single-channel mask patch, its elements may have one of the
+    cv::GrabCutClasses, or 255 for the pixels left unchanged.
+    @param offset Position of the top-left corner of the patch in the image. The patch must lie
+    inside the image.
+    */
+    virtual void applyStroke( InputArray patch, Point offset ) = 0;
+
+    /** @brief Marks the given pixels with value, one of the cv::GrabCutClasses, and updates the
+    segmentation.
+    */
+    virtual void applyStroke( const std::vector<Point>& pixels, int value ) = 0;
+
+    //! returns the current mask, the elements have one of the cv::GrabCutClasses
+    virtual void getMask( OutputArray mask ) const = 0;
+
+    //! returns the background and foreground models, as in cv::grabCut
+    virtual void getModels( OutputArray bgdModel, OutputArray fgdModel ) const = 0;
+};
+
+/** @brief Creates a GrabCut session for the image.
+
+@param img Input 8-bit 3-channel image. The session keeps a reference to it, the image must not be
+modified while the session is used.
+@param mask Input 8-bit single-channel mask, used when mode==GC_INIT_WITH_MASK .
+@param rect ROI containing a segmented object, used when mode==GC_INIT_WITH_RECT .
+@param mode GC_INIT_WITH_RECT or GC_INIT_WITH_MASK, see cv::GrabCutModes.
+@param params Parameters of the algorithm, see cv::GrabCutParams. Only connectivity is used by the
+session.
+ */
+CV_EXPORTS Ptr<GrabCutSession> createGrabCutSession( InputArray img, InputArray mask, Rect rect,
+                                                     int mode = GC_INIT_WITH_RECT,
+                                                     const GrabCutParams& params = GrabCutParams() );
+
+/** @brief Pipelined GrabCut segmentation of a stream of images.
+
+The phases of the iterations of consecutive images overlap: the GMMs of an image are learned and
+its graph is built while the max flow of the previous image is computed, so the sequential parts
+of the phases do not leave the cores idle. The images enter the pipeline while the estimated
+memory of the images in progress stays below the memory limit, the other ones wait in a bounded
+input queue.
+ */
+class CV_EXPORTS GrabCutPipeline : public Algorithm
+{
+public:
+    /** @brief Adds an image to the stream, blocks while the input queue is full.
+
+    @param img Input 8-bit 3-channel image. It must not be modified until its result is popped.
+    @param mask Input mask, used when mode is GC_INIT_WITH_MASK or GC_EVAL.
+    @param rect ROI containing a segmented object, used when mode is GC_INIT_WITH_RECT.
+    @param mode Operation mode that could be one of the cv::GrabCutModes
+    @param bgdModel Background model, used when mode is GC_EVAL.
+    @param fgdModel Foreground model, used when mode is GC_EVAL.
+    */
+    virtual void push( InputArray img, InputArray mask, Rect rect, int mode,
+                       InputArray bgdModel = noArray(), InputArray fgdModel = noArray() ) = 0;
+
+    /** @brief Gets the result of the oldest image of the stream, blocks until it is segmented.
+
+    Returns false when no image was pushed since the last result. An error raised by the
+    segmentation of the image is thrown here.
+    */
+    virtual bool pop( OutputArray mask, OutputArray bgdModel = noArray(), OutputArray fgdModel = noArray(),
+                      GrabCutStats* stats = 0 ) = 0;
+};
+
+/** @brief Creates a GrabCut pipeline.
+
+@param iterCount Number of iterations for each image.
+@param params Parameters of the algorithm, see cv::GrabCutParams.
+@param queueSize Maximal number of images waiting to enter the pipeline.
+@param memoryLimit Maximal estimated memory, in bytes, of the images in progress. An image is
+always accepted when no other one is in progress. 0 stands for half the physical memory.
+ */
+CV_EXPORTS Ptr<GrabCutPipeline> createGrabCutPipeline( int iterCount, const GrabCutParams& params = GrabCutParams(),
+                                                       int queueSize = 4, size_t memoryLimit = 0 );
+
+/** @brief Source of the image and destination of the mask of cv::grabCutTiled.
+
+The image is read by rectangles, so that it can be decoded or mapped piece by piece and never
+held whole in memory.
+ */
+class CV_EXPORTS GrabCutTileIO
+{
+public:
+    virtual ~GrabCutTileIO() {}
+    //! returns the size of the image
+    virtual Size size() const = 0;
+    //! reads the pixels of roi into img, as an 8-bit 3-channel matrix of the size of roi
+    virtual void readImage( Rect roi, Mat& img ) = 0;
+    //! reads the input mask of roi into mask, as an 8-bit single-channel matrix of the size of
+    //! roi. It is only called in the GC_INIT_WITH_MASK mode, the default implementation raises an
+    //! error.
+    virtual void readMask( Rect roi, Mat& mask );
+    //! writes the resulting mask of roi. A rectangle may overlap the ones written before, whose
+    //! elements it replaces.
+    virtual void writeMask( Rect roi, const Mat& mask ) = 0;
+};
+
+/** @brief Runs the GrabCut algorithm on an image by tiles, with a memory bounded by the tile size
+and the image width.
+
+The image is cut in tiles of tileSize x tileSize pixels. Each tile is read with a halo of halo
+pixels on each side, and segmented on its own graph. The GMMs of a tile are learned from its pixels
+and from a sample of the whole image, gathered by a first pass over the tiles and weighted as the
+pixels it stands for, so that the models stay close to the ones of the whole image, and a tile
+which holds a single class still gets both. The labels of two neighboring tiles are then
+stitched by a seam refinement: the pixels closer than halo to their common edge on which the two
+segmentations disagree are segmented again, the other ones being fixed.
+
+The memory used is bounded by a tile with its halo, the sample, and 2*halo full-width rows of the
+mask, kept for the seams with the next row of tiles: the peak memory is O(tileSize^2 + width*halo).
+The pyramid and superpixel modes of params are ignored.
+
+@param io Source of the image and destination of the mask, see cv::GrabCutTileIO.
+@param rect ROI containing a segmented object, used when mode is GC_INIT_WITH_RECT.
+@param iterCount Number of iterations the algorithm runs on each tile.
+@param mode GC_INIT_WITH_RECT or GC_INIT_WITH_MASK, see cv::GrabCutModes, possibly combined with
+GC_ROI_ONLY, which restricts the graph of each tile to its GC_PR_BGD and GC_PR_FGD pixels.
+@param tileSize Size of the tiles, not smaller than 2*halo.
+@param halo Width of the band around a tile segmented with it, and of the seams.
+@param params Parameters of the algorithm, see cv::GrabCutParams.
+ */
+CV_EXPORTS void grabCutTiled( GrabCutTileIO& io, Rect rect, int iterCount, int mode,
+                              int tileSize = 1024, int halo = 32,
+                              const GrabCutParams& params = GrabCutParams() );
+
+/** @overload
+@param img Input 8-bit 3-channel image, for instance a matrix on a memory-mapped file.
+@param mask Input/output 8-bit single-channel mask, of the size of img.
+ */
+CV_EXPORTS void grabCutTiled( InputArray img, InputOutputArray mask, Rect rect, int iterCount, int mode,
+                              int tileSize = 1024, int halo = 32,
+                              const GrabCutParams& params = GrabCutParams() );
+
 /** @example distrans.cpp
 An example on using the distance transform\
 */
@@ -42,28 +42,423 @@
 #ifndef _CV_GCGRAPH_H_
 #define _CV_GCGRAPH_H_
 
-template <class TWeight> class GCGraph
+#include <mutex>
+#include <string>
+#include <map>
+#include <algorithm>
+#include <limits>
+#include <type_traits>
+#include <cstdlib>
+#if defined __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+/*
+ Memory of the vertex and edge arrays of graphs. The blocks released by a graph are kept and given
+ back to the next graphs, so that building graphs of similar sizes again does not allocate nor
+ fault in new pages.
+ With hugePages, the blocks are aligned on 2 MB and backed by transparent huge pages where the
+ system supports them (madvise), which reduces the TLB misses of maxFlow on large graphs.
+ On a NUMA machine (see setNodes), each block is split in as many parts as nodes, the k-th part
+ being placed on the k-th node (mbind). The vertices and edges of a graph of the image follow its
+ rows, so the part of a band of rows is local to the threads which solve its regions.
+ With a storage directory (see setStorage), the blocks which do not fit in the memory limit are
+ mapped from temporary files of the directory (Linux), so that graphs larger than the memory can
+ be solved: the system pages them in and out, guided by advise.
+*/
+class GCGraphArena
+{
+public:
+	explicit GCGraphArena(bool hugePages = false);
+	~GCGraphArena();
+	void* allocate(size_t size);
+	void deallocate(void* ptr, size_t size);
+	void release(); // free the kept blocks
+	size_t memoryUsage() const; // size of the blocks, kept or used, in bytes
+	void setNodes(const std::vector<int>& nodes); // ids of the NUMA nodes of the new blocks
+	void setStorage(const std::string& dir, size_t memoryLimit);
+	void advise(const void* ptr, size_t size, bool willNeed);
+	bool hasStorage() const { return !storage.empty(); }
+private:
+	struct Block
+	{
+		void* ptr;
+		size_t size;
+		bool file; // mapped from a file of the storage directory
+	};
+
+	GCGraphArena(const GCGraphArena&);
+	GCGraphArena& operator=(const GCGraphArena&);
+	Block map(size_t size);
+	void unmap(const Block& b);
+	void* mapFile(size_t size);
+	void bindNodes(void* ptr, size_t size);
+	size_t blockSize(size_t size) const;
+
+	std::vector<Block> blocks; // released blocks
+	std::vector<Block> used; // allocated blocks, a reused one may be larger than requested
+	bool hugePages;
+	std::vector<int> nodes;
+	bool mapped; // memory blocks allocated by mmap
+	std::string storage;
+	size_t memoryLimit, memorySize; // limit and size of the blocks not in files
+	mutable std::mutex mtx;
+};
+
+inline GCGraphArena::GCGraphArena(bool _hugePages) : memoryLimit(0), memorySize(0)
+{
+#if defined __linux__ && defined MADV_HUGEPAGE
+	hugePages = _hugePages;
+#else
+	hugePages = false;
+	(void)_hugePages;
+#endif
+	mapped = hugePages;
+}
+
+inline GCGraphArena::~GCGraphArena()
+{
+	release();
+	for (size_t i = 0; i < used.size(); i++)
+		unmap(used[i]);
+}
+
+/*
+ To be called before the first allocation
+*/
+inline void GCGraphArena::setNodes(const std::vector<int>& _nodes)
+{
+	CV_Assert(used.empty() && blocks.empty());
+#if defined __linux__ && defined __NR_mbind
+	if (_nodes.size() > 1)
+	{
+		nodes = _nodes;
+		mapped = true;
+	}
+#else
+	(void)_nodes;
+#endif
+}
+
+/*
+ To be called before the first allocation. The blocks are allocated in memory while their total
+ size stays below memoryLimit, then in files of dir.
+*/
+inline void GCGraphArena::setStorage(const std::string& dir, size_t _memoryLimit)
+{
+	CV_Assert(used.empty() && blocks.empty());
+#if defined __linux__
+	storage = dir;
+	memoryLimit = _memoryLimit;
+#else
+	(void)dir;
+	(void)_memoryLimit;
+#endif
+}
+
+inline void GCGraphArena::bindNodes(void* ptr, size_t size)
+{
+#if defined __linux__ && defined __NR_mbind
+	const int MPOL_PREFERRED_ = 1; // MPOL_PREFERRED of linux/mempolicy.h
+	const size_t page = hugePages ? (size_t)2 << 20 : 4096;
+	const size_t bits = 8 * sizeof(unsigned long);
+	int maxId = *std::max_element(nodes.begin(), nodes.end());
+	std::vector<unsigned long> mask(maxId / bits + 1);
+	for (size_t k = 0; k < nodes.size(); k++)
+	{
+		size_t begin = size * k / nodes.size() / page * page, end = size * (k + 1) / nodes.size() / page * page;
+		if (k + 1 == nodes.size())
+			end = size;
+		if (end <= begin)
+			continue;
+		std::fill(mask.begin(), mask.end(), 0);
+		mask[nodes[k] / bits] |= 1ul << (nodes[k] % bits);
+		// the placement is a hint: a failure leaves the default policy
+		syscall(__NR_mbind, (uchar*)ptr + begin, end - begin, MPOL_PREFERRED_, mask.data(), mask.size() * bits + 1, 0);
+	}
+#else
+	(void)ptr;
+	(void)size;
+#endif
+}
+
+inline size_t GCGraphArena::blockSize(size_t size) const
+{
+	const size_t align = hugePages ? (size_t)2 << 20 : 4096;
+	return (size + align - 1) & ~(align - 1);
+}
+
+/*
+ The file is removed at once, its space being released with the mapping
+*/
+inline void* GCGraphArena::mapFile(size_t size)
+{
+#if defined __linux__
+	std::string path = storage + "/gcgraph-XXXXXX";
+	std::vector<char> name(path.begin(), path.end());
+	name.push_back(0);
+	int fd = mkstemp(name.data());
+	if (fd < 0)
+		CV_Error(CV_StsError, "failed to create a graph storage file");
+	unlink(name.data());
+	void* p = ftruncate(fd, (off_t)size) == 0 ?
+		mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+	close(fd);
+	if (p == MAP_FAILED)
+		CV_Error(CV_StsNoMem, "failed to map a graph storage file");
+	return p;
+#else
+	(void)size;
+	return 0;
+#endif
+}
+
+inline GCGraphArena::Block GCGraphArena::map(size_t size)
+{
+	Block b = { 0, size, false };
+#if defined __linux__
+	if (!storage.empty() && memorySize + size > memoryLimit)
+	{
+		b.ptr = mapFile(size);
+		b.file = true;
+		if (!nodes.empty())
+			bindNodes(b.ptr, size);
+		return b;
+	}
+#endif
+	memorySize += size;
+#if defined __linux__
+	if (!hugePages && mapped)
+	{
+		b.ptr = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (b.ptr == MAP_FAILED)
+			CV_Error(CV_StsNoMem, "failed to map the memory of the graph");
+		if (!nodes.empty())
+			bindNodes(b.ptr, size);
+		return b;
+	}
+#endif
+#if defined __linux__ && defined MADV_HUGEPAGE
+	if (hugePages)
+	{
+		// over-allocate to align the block on a huge page
+		const size_t align = (size_t)2 << 20;
+		uchar* p = (uchar*)mmap(0, size + align, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (p == (uchar*)MAP_FAILED)
+			CV_Error(CV_StsNoMem, "failed to map the memory of the graph");
+		uchar* aligned = (uchar*)(((size_t)p + align - 1) & ~(align - 1));
+		if (aligned > p)
+			munmap(p, aligned - p);
+		munmap(aligned + size, p + align - aligned);
+		madvise(aligned, size, MADV_HUGEPAGE);
+		if (!nodes.empty())
+			bindNodes(aligned, size);
+		b.ptr = aligned;
+		return b;
+	}
+#endif
+	b.ptr = ::operator new(size);
+	return b;
+}
+
+inline void GCGraphArena::unmap(const Block& b)
+{
+#if defined __linux__
+	if (b.file || mapped)
+	{
+		if (!b.file)
+			memorySize -= b.size;
+		munmap(b.ptr, b.size);
+		return;
+	}
+#endif
+	memorySize -= b.size;
+	::operator delete(b.ptr);
+}
+
+/*
+ The smallest kept block large enough is reused. When there is none, the kept blocks too small
+ for the request are freed, as the arrays outgrew them.
+*/
+inline void* GCGraphArena::allocate(size_t size)
+{
+	size = blockSize(size);
+	std::lock_guard<std::mutex> lk(mtx);
+	int best = -1;
+	for (int i = 0; i < (int)blocks.size(); i++)
+		if (blocks[i].size >= size && (best < 0 || blocks[i].size < blocks[best].size))
+			best = i;
+	if (best >= 0)
+	{
+		used.push_back(blocks[best]);
+		blocks.erase(blocks.begin() + best);
+		return used.back().ptr;
+	}
+	for (int i = (int)blocks.size() - 1; i >= 0; i--)
+		if (blocks[i].size < size)
+		{
+			unmap(blocks[i]);
+			blocks.erase(blocks.begin() + i);
+		}
+	used.push_back(map(size));
+	return used.back().ptr;
+}
+
+inline void GCGraphArena::deallocate(void* ptr, size_t)
+{
+	std::lock_guard<std::mutex> lk(mtx);
+	for (size_t i = 0; i < used.size(); i++)
+		if (used[i].ptr == ptr)
+		{
+			blocks.push_back(used[i]);
+			used.erase(used.begin() + i);
+			return;
+		}
+	CV_Assert(0 && "the block was not allocated by the arena");
+}
+
+inline void GCGraphArena::release()
+{
+	std::lock_guard<std::mutex> lk(mtx);
+	for (size_t i = 0; i < blocks.size(); i++)
+		unmap(blocks[i]);
+	blocks.clear();
+}
+
+inline size_t GCGraphArena::memoryUsage() const
+{
+	std::lock_guard<std::mutex> lk(mtx);
+	size_t size = 0;
+	for (size_t i = 0; i < blocks.size(); i++)
+		size += blocks[i].size;
+	for (size_t i = 0; i < used.size(); i++)
+		size += used[i].size;
+	return size;
+}
+
+/*
+ Tell the system that the range [ptr, ptr + size) is about to be used (willNeed), or that it
+ is not used any more, when it lies in a block mapped from a file: its pages are read ahead,
+ or may be written back and dropped. Memory blocks are left as they are.
+*/
+inline void GCGraphArena::advise(const void* ptr, size_t size, bool willNeed)
+{
+#if defined __linux__
+	if (storage.empty() || size == 0)
+		return;
+	bool file = false;
+	{
+		std::lock_guard<std::mutex> lk(mtx);
+		for (size_t i = 0; i < used.size() && !file; i++)
+			file = used[i].file && (const uchar*)ptr >= (const uchar*)used[i].ptr &&
+				(const uchar*)ptr + size <= (const uchar*)used[i].ptr + used[i].size;
+	}
+	if (!file)
+		return;
+	const size_t page = 4096;
+	uchar* begin = (uchar*)((size_t)ptr & ~(page - 1));
+	madvise(begin, (const uchar*)ptr + size - begin, willNeed ? MADV_WILLNEED : MADV_DONTNEED);
+#else
+	(void)ptr;
+	(void)size;
+	(void)willNeed;
+#endif
+}
+
+/*
+ Allocator of the arrays of GCGraph: from an arena when given, from the heap otherwise
+*/
+template <class T> class GCGraphAllocator
+{
+public:
+	typedef T value_type;
+	GCGraphAllocator(GCGraphArena* _arena = 0) : arena(_arena) {}
+	template <class U> GCGraphAllocator(const GCGraphAllocator<U>& a) : arena(a.arena) {}
+	T* allocate(size_t n)
+	{
+		return (T*)(arena ? arena->allocate(n * sizeof(T)) : ::operator new(n * sizeof(T)));
+	}
+	void deallocate(T* ptr, size_t n)
+	{
+		if (arena)
+			arena->deallocate(ptr, n * sizeof(T));
+		else
+			::operator delete(ptr);
+	}
+	template <class U> bool operator==(const GCGraphAllocator<U>& a) const { return arena == a.arena; }
+	template <class U> bool operator!=(const GCGraphAllocator<U>& a) const { return arena != a.arena; }
+
+	GCGraphArena* arena;
+};
+
+/*
+ Signed type of the flows of the edge pairs of GCGraph, for a type of capacities TCap
+*/
+template <class TCap, bool isInteger = std::numeric_limits<TCap>::is_integer> struct GCGraphFlow
+{
+	typedef TCap type;
+};
+
+template <class TCap> struct GCGraphFlow<TCap, true>
+{
+	typedef typename std::make_signed<TCap>::type type;
+};
+
+/*
+ TIndex is the type of the indices of the vertices and edges, int by default for the density of
+ the arrays. The edges of a graph with more than INT_MAX of them need a 64-bit type (see
+ needsWideGCGraph in grabcut.cpp).
+ The edges e and e^1 of a pair share a capacity and a signed flow (see Pair), from which both
+ residual capacities are derived, so that an augmentation writes a single value.
+ The edges of each vertex are listed contiguously (compressed sparse rows, see finalize), so that
+ the scans of maxFlow read them in sequence. The edges added to a solved graph are listed in time
+ proportional to their number.
+ TCap is the type of the capacities of the edges. With an integer type (e.g. ushort), the
+ capacities are quantized: the weights given to the graph are rounded to multiples of the quantum
+ (see setQuantum), the t-weights included so that the flows stay integer, and the max flow is
+ returned in the units of the weights. The capacities and flows which do not fit in their type
+ are kept in a side table (overflow), their pair holding the largest capacity, or the smallest
+ flow, of the type.
+*/
+template <class TWeight, class TIndex = int, class TCap = TWeight> class GCGraph
 {
 public:
 	TWeight sourceToSinkW; // Graph reduction possibly creates an edge from source to sink. It is not used in MaxFlow
-	GCGraph();
-	GCGraph(unsigned int vtxCount, unsigned int edgeCount);
+	explicit GCGraph(GCGraphArena* arena = 0); // the vertices and edges are allocated from arena, when given
+	GCGraph(size_t vtxCount, size_t edgeCount);
 	~GCGraph();
-	void create(unsigned int vtxCount, unsigned int edgeCount);
-	int addVtx();
-	int addVtx(int r, int alt_r);
-	void addEdges(int i, int j, TWeight w, TWeight revw);
-	void addTermWeights(int i, TWeight sourceW, TWeight sinkW);
+	void create(size_t vtxCount, size_t edgeCount);
+	void clear(); // remove the vertices and edges, keeping the allocated memory
+	void release(); // remove the vertices and edges, and free the memory
+	TIndex addVtx();
+	TIndex addVtx(int r, int alt_r);
+	TIndex addEdges(TIndex i, TIndex j, TWeight w, TWeight revw);
+	void addTermWeights(TIndex i, TWeight sourceW, TWeight sinkW);
+	void setEdgeWeights(TIndex e, TWeight w, TWeight revw); // rewrite the capacities of a graph, see resetFlow
+	void setTermWeights(TIndex i, TWeight sourceW, TWeight sinkW);
+	void resetFlow();
+	void updateTermWeights(TIndex i, TWeight dSourceW, TWeight dSinkW); // dynamic graph cuts, see maxFlow(bool)
 	TWeight maxFlow();
+	TWeight maxFlow(bool reuseTrees); // warm-started maxFlow, after updateTermWeights
 	TWeight maxFlow(int reg, const int reg_flag); // overloaded function for parallel maxFlow 
-	inline bool inSourceSegment(int i);
+	inline bool inSourceSegment(TIndex i);
+	TIndex vtxCount() const { return (TIndex)vtcs.size(); }
+	size_t memoryUsage() const;
+	static size_t memoryUsage(size_t vtxCount, size_t edgeCount); // estimate for a graph of this size
+	// vertices [vtx0, vtx1) and edges [edge0, edge1) of region reg (regions of flag 0), see adviseRegion
+	void setRegionSpan(int reg, TIndex vtx0, TIndex vtx1, TIndex edge0, TIndex edge1);
+	void adviseRegion(int reg, bool willNeed);
+	TIndex edgeCount() const { return (TIndex)edges.size(); }
+	void finalize(); // list the edges of the vertices, after adding edges and before maxFlow(reg, reg_flag)
+	void setQuantum(TWeight q); // weight of a unit of integer capacities, to be set before the edges
 private:
 	class Vtx
 	{
 	public:
-		Vtx *next; // initialized and used in maxFlow() only
-		int parent;
-		int first;
+		TIndex next; // active queue of maxFlow, see pushActive
+		TIndex parent;
 		int ts;
 		int dist;
 		TWeight weight; 
@@ -73,90 +468,472 @@ private:
 	class Edge
 	{
 	public:
-		int dst;
-		int next;
-		TWeight weight;
+		TIndex dst;
+	};
+	// edge e from a vertex to dst, in the list of the vertex
+	struct Arc
+	{
+		TIndex dst;
+		TIndex e;
+	};
+	// edges of a vertex, arcs[begin] to arcs[end - 1]
+	struct ArcList
+	{
+		TIndex begin, end;
 	};
+	typedef typename GCGraphFlow<TCap>::type TFlow;
+	// edges 2k and 2k+1: the residual capacity of 2k is cap - flow, the one of 2k+1 cap + flow
+	struct Pair
+	{
+		TCap cap;
+		TFlow flow;
+	};
+
+	static const bool quantized = std::numeric_limits<TCap>::is_integer;
+	bool finalized() const;
+	TWeight units(TWeight w) const; // weight w in the units of the capacities
+	TWeight toWeight(TWeight u) const; // the reverse
+	TWeight pairCap(const Pair* pairPtr, TIndex e);
+	TWeight pairFlow(const Pair* pairPtr, TIndex e);
+	void setPairFlow(Pair* pairPtr, TIndex e, TWeight f);
+	void setPair(TIndex e, TWeight w, TWeight revw);
+	TWeight residual(const Pair* pairPtr, TIndex e);
+	TWeight augment(Pair* pairPtr, TIndex e, TWeight m);
+	void pushActive(Vtx* vtxPtr, Vtx* v, TIndex& first, TIndex& last);
+	void popActive(Vtx* v, TIndex& first, TIndex& last);
 
-	std::vector<Vtx> vtcs;
-	std::vector<Edge> edges;
+	std::vector<Vtx, GCGraphAllocator<Vtx> > vtcs;
+	std::vector<Edge, GCGraphAllocator<Edge> > edges;
+	std::vector<Pair, GCGraphAllocator<Pair> > pairs; // pairs[k] of the edges 2k and 2k+1
+	// the edges from vertex i are listed by lists[i]
+	std::vector<Arc, GCGraphAllocator<Arc> > arcs;
+	std::vector<ArcList, GCGraphAllocator<ArcList> > lists;
+	TIndex listedEdges; // number of edges (the 2 unused ones included) listed by finalize
+	TIndex unusedArcs; // arcs left by the lists moved to the end of arcs, see finalize
 	TWeight flow; 
+	int curr_ts; // time stamp of the search trees, kept between warm-started maxFlow calls
+	std::vector<TIndex> changedVtcs; // vertices modified by updateTermWeights since the last maxFlow
+	// orphan stacks of maxFlow, and of maxFlow(reg, reg_flag) for each region, kept between the
+	// calls so that they do not allocate once they reached their size
+	std::vector<TIndex> orphanStack;
+	std::vector<std::vector<TIndex> > regionOrphanStacks;
+	struct Span
+	{
+		TIndex vtx0, vtx1, edge0, edge1;
+	};
+	std::vector<Span> regionSpans;
+	TWeight quantum, invQuantum;
+	std::map<TIndex, TWeight> overflow; // capacity of pair k at 2k, flow at 2k+1
+	std::mutex regionMtx; // the regions solved in parallel share the side table and the flow
 };
 
-template <class TWeight>
-GCGraph<TWeight>::GCGraph()
+template <class TWeight, class TIndex, class TCap>
+GCGraph<TWeight, TIndex, TCap>::GCGraph(GCGraphArena* arena) : vtcs(GCGraphAllocator<Vtx>(arena)), edges(GCGraphAllocator<Edge>(arena)),
+	pairs(GCGraphAllocator<Pair>(arena)), arcs(GCGraphAllocator<Arc>(arena)), lists(GCGraphAllocator<ArcList>(arena)),
+	listedEdges(2), unusedArcs(0), quantum(1), invQuantum(1)
 {
 	flow = 0;
 	sourceToSinkW = 0;
+	curr_ts = 0;
 }
 
-template <class TWeight>
-GCGraph<TWeight>::GCGraph(unsigned int vtxCount, unsigned int edgeCount)
+template <class TWeight, class TIndex, class TCap>
+GCGraph<TWeight, TIndex, TCap>::GCGraph(size_t vtxCount, size_t edgeCount) : listedEdges(2), unusedArcs(0),
+	quantum(1), invQuantum(1)
 {
 	create(vtxCount, edgeCount);
 }
-template <class TWeight>
-GCGraph<TWeight>::~GCGraph()
+template <class TWeight, class TIndex, class TCap>
+GCGraph<TWeight, TIndex, TCap>::~GCGraph()
 {
 }
-template <class TWeight>
-void GCGraph<TWeight>::create(unsigned int vtxCount, unsigned int edgeCount)
+template <class TWeight, class TIndex, class TCap>
+void GCGraph<TWeight, TIndex, TCap>::create(size_t vtxCount, size_t edgeCount)
 {
 	vtcs.reserve(vtxCount);
 	edges.reserve(edgeCount + 2);
+	pairs.reserve(edgeCount / 2 + 1);
+	arcs.reserve(edgeCount);
+	lists.reserve(vtxCount);
 	flow = 0;
 }
 
-template <class TWeight>
-int GCGraph<TWeight>::addVtx()
+template <class TWeight, class TIndex, class TCap>
+void GCGraph<TWeight, TIndex, TCap>::clear()
+{
+	vtcs.clear();
+	edges.clear();
+	pairs.clear();
+	arcs.clear();
+	lists.clear();
+	listedEdges = 2;
+	unusedArcs = 0;
+	changedVtcs.clear();
+	regionSpans.clear();
+	overflow.clear();
+	flow = 0;
+	sourceToSinkW = 0;
+	curr_ts = 0;
+}
+
+template <class TWeight, class TIndex, class TCap>
+void GCGraph<TWeight, TIndex, TCap>::release()
+{
+	clear();
+	std::vector<Vtx, GCGraphAllocator<Vtx> >(vtcs.get_allocator()).swap(vtcs);
+	std::vector<Edge, GCGraphAllocator<Edge> >(edges.get_allocator()).swap(edges);
+	std::vector<Pair, GCGraphAllocator<Pair> >(pairs.get_allocator()).swap(pairs);
+	std::vector<Arc, GCGraphAllocator<Arc> >(arcs.get_allocator()).swap(arcs);
+	std::vector<ArcList, GCGraphAllocator<ArcList> >(lists.get_allocator()).swap(lists);
+	std::vector<TIndex>().swap(changedVtcs);
+	std::vector<TIndex>().swap(orphanStack);
+	std::vector<std::vector<TIndex> >().swap(regionOrphanStacks);
+}
+
+/*
+ Memory of the vertex and edge arrays of a finalized graph of vtxCount vertices and edgeCount
+ edges, the search trees and the side table of the quantized capacities excluded.
+*/
+template <class TWeight, class TIndex, class TCap>
+size_t GCGraph<TWeight, TIndex, TCap>::memoryUsage(size_t vtxCount, size_t edgeCount)
+{
+	return vtxCount*(sizeof(Vtx) + sizeof(ArcList)) + edgeCount*(sizeof(Edge) + sizeof(Arc)) +
+		(edgeCount + 1)/2*sizeof(Pair);
+}
+
+/*
+ Memory allocated by the graph, in bytes. The arrays allocated from an arena are counted by
+ the arena.
+*/
+template <class TWeight, class TIndex, class TCap>
+size_t GCGraph<TWeight, TIndex, TCap>::memoryUsage() const
+{
+	size_t size = changedVtcs.capacity()*sizeof(TIndex) + orphanStack.capacity()*sizeof(TIndex) +
+		overflow.size()*(sizeof(TIndex) + sizeof(TWeight) + 4*sizeof(void*));
+	if (!vtcs.get_allocator().arena)
+		size += vtcs.capacity()*sizeof(Vtx) + edges.capacity()*sizeof(Edge) + pairs.capacity()*sizeof(Pair) +
+			arcs.capacity()*sizeof(Arc) + lists.capacity()*sizeof(ArcList);
+	for (size_t i = 0; i < regionOrphanStacks.size(); i++)
+		size += regionOrphanStacks[i].capacity()*sizeof(TIndex);
+	return size;
+}
+
+template <class TWeight, class TIndex, class TCap>
+void GCGraph<TWeight, TIndex, TCap>::setRegionSpan(int reg, TIndex vtx0, TIndex vtx1, TIndex edge0, TIndex edge1)
+{
+	if (reg >= (int)regionSpans.size())
+	{
+		Span empty = { 0, 0, 0, 0 };
+		regionSpans.resize(reg + 1, empty);
+	}
+	Span span = { vtx0, vtx1, edge0, edge1 };
+	regionSpans[reg] = span;
+}
+
+template <class TWeight, class TIndex, class TCap>
+void GCGraph<TWeight, TIndex, TCap>::setQuantum(TWeight q)
+{
+	CV_Assert(q > 0 && edges.empty());
+	quantum = q;
+	invQuantum = 1 / q;
+}
+
+template <class TWeight, class TIndex, class TCap>
+inline TWeight GCGraph<TWeight, TIndex, TCap>::units(TWeight w) const
+{
+	return quantized ? std::floor(w*invQuantum + (TWeight)0.5) : w;
+}
+
+template <class TWeight, class TIndex, class TCap>
+inline TWeight GCGraph<TWeight, TIndex, TCap>::toWeight(TWeight u) const
+{
+	return quantized ? u*quantum : u;
+}
+
+template <class TWeight, class TIndex, class TCap>
+inline TWeight GCGraph<TWeight, TIndex, TCap>::pairCap(const Pair* pairPtr, TIndex e)
+{
+	const Pair& p = pairPtr[e >> 1];
+	if (!quantized || p.cap != std::numeric_limits<TCap>::max())
+		return (TWeight)p.cap;
+	std::lock_guard<std::mutex> lk(regionMtx);
+	return overflow[e & ~(TIndex)1];
+}
+
+template <class TWeight, class TIndex, class TCap>
+inline TWeight GCGraph<TWeight, TIndex, TCap>::pairFlow(const Pair* pairPtr, TIndex e)
+{
+	const Pair& p = pairPtr[e >> 1];
+	if (!quantized || p.flow != std::numeric_limits<TFlow>::min())
+		return (TWeight)p.flow;
+	std::lock_guard<std::mutex> lk(regionMtx);
+	return overflow[e | 1];
+}
+
+template <class TWeight, class TIndex, class TCap>
+inline void GCGraph<TWeight, TIndex, TCap>::setPairFlow(Pair* pairPtr, TIndex e, TWeight f)
+{
+	const TFlow minFlow = std::numeric_limits<TFlow>::min();
+	Pair& p = pairPtr[e >> 1];
+	if (!quantized)
+	{
+		p.flow = (TFlow)f;
+		return;
+	}
+	if (f > (TWeight)minFlow && f <= (TWeight)std::numeric_limits<TFlow>::max())
+	{
+		if (p.flow == minFlow)
+		{
+			std::lock_guard<std::mutex> lk(regionMtx);
+			overflow.erase(e | 1);
+		}
+		p.flow = (TFlow)f;
+		return;
+	}
+	std::lock_guard<std::mutex> lk(regionMtx);
+	overflow[e | 1] = f;
+	p.flow = minFlow;
+}
+
+/*
+ Set the capacities w of edge e and revw of its reverse edge, and cancel their flow. When they
+ differ, the pair gets their mean as capacity and starts with a flow making up the difference.
+*/
+template <class TWeight, class TIndex, class TCap>
+void GCGraph<TWeight, TIndex, TCap>::setPair(TIndex e, TWeight w, TWeight revw)
+{
+	if (e & 1)
+		std::swap(w, revw);
+	TWeight c = units((w + revw) / 2), f = units((revw - w) / 2);
+	const TCap maxCap = std::numeric_limits<TCap>::max();
+	Pair& p = pairs[e >> 1];
+	if (quantized && c >= (TWeight)maxCap)
+	{
+		std::lock_guard<std::mutex> lk(regionMtx);
+		overflow[e & ~(TIndex)1] = c;
+		p.cap = maxCap;
+	}
+	else
+	{
+		if (quantized && p.cap == maxCap)
+		{
+			std::lock_guard<std::mutex> lk(regionMtx);
+			overflow.erase(e & ~(TIndex)1);
+		}
+		p.cap = (TCap)c;
+	}
+	setPairFlow(pairs.data(), e, f);
+}
+
+template <class TWeight, class TIndex, class TCap>
+inline TWeight GCGraph<TWeight, TIndex, TCap>::residual(const Pair* pairPtr, TIndex e)
+{
+	TWeight c = pairCap(pairPtr, e), f = pairFlow(pairPtr, e);
+	return (e & 1) ? c + f : c - f;
+}
+
+/*
+ The active queue of maxFlow is a FIFO of vertex indices, first and last being -1 when it is
+ empty. It is linked through Vtx::next: 0 for a vertex out of the queue, -1 for its last vertex,
+ and i + 1 for the vertex before vertex i.
+*/
+template <class TWeight, class TIndex, class TCap>
+inline void GCGraph<TWeight, TIndex, TCap>::pushActive(Vtx* vtxPtr, Vtx* v, TIndex& first, TIndex& last)
+{
+	TIndex i = (TIndex)(v - vtxPtr);
+	v->next = -1;
+	if (last >= 0)
+		vtxPtr[last].next = i + 1;
+	else
+		first = i;
+	last = i;
+}
+
+template <class TWeight, class TIndex, class TCap>
+inline void GCGraph<TWeight, TIndex, TCap>::popActive(Vtx* v, TIndex& first, TIndex& last)
+{
+	first = v->next > 0 ? v->next - 1 : -1;
+	if (first < 0)
+		last = -1;
+	v->next = 0;
+}
+
+/*
+ Push m along edge e, which increases the residual capacity of e^1 by as much. Returns the new
+ residual capacity of e, set to 0 exactly when e is saturated so that the rounding of the flow
+ leaves no residue.
+*/
+template <class TWeight, class TIndex, class TCap>
+inline TWeight GCGraph<TWeight, TIndex, TCap>::augment(Pair* pairPtr, TIndex e, TWeight m)
+{
+	TWeight c = pairCap(pairPtr, e), f = pairFlow(pairPtr, e);
+	if (e & 1)
+	{
+		f = m >= c + f ? -c : std::max(f - m, -c);
+		setPairFlow(pairPtr, e, f);
+		return c + f;
+	}
+	f = m >= c - f ? c : std::min(f + m, c);
+	setPairFlow(pairPtr, e, f);
+	return c - f;
+}
+
+template <class TWeight, class TIndex, class TCap>
+void GCGraph<TWeight, TIndex, TCap>::adviseRegion(int reg, bool willNeed)
+{
+	GCGraphArena* arena = vtcs.get_allocator().arena;
+	if (!arena || !arena->hasStorage() || reg >= (int)regionSpans.size())
+		return;
+	const Span& span = regionSpans[reg];
+	arena->advise(vtcs.data() + span.vtx0, (span.vtx1 - span.vtx0)*sizeof(Vtx), willNeed);
+	arena->advise(edges.data() + span.edge0, (span.edge1 - span.edge0)*sizeof(Edge), willNeed);
+	arena->advise(pairs.data() + span.edge0 / 2, (span.edge1 - span.edge0) / 2 * sizeof(Pair), willNeed);
+	// the lists of the region are contiguous, unless edges were added since they were sorted
+	if (span.vtx0 < span.vtx1 && span.vtx1 <= (TIndex)lists.size() && lists[span.vtx0].begin < lists[span.vtx1 - 1].end)
+		arena->advise(arcs.data() + lists[span.vtx0].begin, (lists[span.vtx1 - 1].end - lists[span.vtx0].begin)*sizeof(Arc), willNeed);
+}
+
+template <class TWeight, class TIndex, class TCap>
+TIndex GCGraph<TWeight, TIndex, TCap>::addVtx()
 {
 	Vtx v;
 	memset(&v, 0, sizeof(Vtx));
 	vtcs.push_back(v);
-	return (int)vtcs.size() - 1;
+	return (TIndex)vtcs.size() - 1;
 }
 
-template <class TWeight>
-int GCGraph<TWeight>::addVtx(int r, int alt_r)
+template <class TWeight, class TIndex, class TCap>
+TIndex GCGraph<TWeight, TIndex, TCap>::addVtx(int r, int alt_r)
 {
 	Vtx v;
 	memset(&v, 0, sizeof(Vtx));
 	v.region[0] = r;
 	v.region[1] = alt_r;
 	vtcs.push_back(v);
-	return (int)vtcs.size() - 1;
+	int regionCount = std::max(r, alt_r) + 1;
+	if (regionCount > (int)regionOrphanStacks.size())
+		regionOrphanStacks.resize(regionCount);
+	return (TIndex)vtcs.size() - 1;
 }
 
-template <class TWeight>
-void GCGraph<TWeight>::addEdges(int i, int j, TWeight w, TWeight revw)
+/*
+ Returns the index of the edge from i to j, the edge from j to i being the next one
+*/
+template <class TWeight, class TIndex, class TCap>
+TIndex GCGraph<TWeight, TIndex, TCap>::addEdges(TIndex i, TIndex j, TWeight w, TWeight revw)
 {
-	CV_Assert(i >= 0 && i<(int)vtcs.size());
-	CV_Assert(j >= 0 && j<(int)vtcs.size());
+	CV_Assert(i >= 0 && i < (TIndex)vtcs.size());
+	CV_Assert(j >= 0 && j < (TIndex)vtcs.size());
 	CV_Assert(w >= 0 && revw >= 0);
 	CV_Assert(i != j);
 
 	if (!edges.size())
+	{
 		edges.resize(2);
+		pairs.resize(1);
+	}
 
+	TIndex e = (TIndex)edges.size();
 	Edge fromI, toI;
 	fromI.dst = j;
-	fromI.next = vtcs[i].first;
-	fromI.weight = w;
-	vtcs[i].first = (int)edges.size();
 	edges.push_back(fromI);
-
 	toI.dst = i;
-	toI.next = vtcs[j].first;
-	toI.weight = revw;
-	vtcs[j].first = (int)edges.size();
 	edges.push_back(toI);
+
+	pairs.push_back(Pair());
+	setPair(e, w, revw);
+	return e;
 }
 
-template <class TWeight>
-void GCGraph<TWeight>::addTermWeights(int i, TWeight sourceW, TWeight sinkW)
+template <class TWeight, class TIndex, class TCap>
+inline bool GCGraph<TWeight, TIndex, TCap>::finalized() const
 {
-	CV_Assert(i >= 0 && i<(int)vtcs.size());
+	return lists.size() == vtcs.size() && (size_t)listedEdges == std::max(edges.size(), (size_t)2);
+}
 
+/*
+ Build the lists of the edges of the vertices (compressed sparse rows) from the edges added so
+ far, the edges of a vertex being listed from the last added one. The source of edge e is the
+ destination of e^1. Nothing is done when no vertex nor edge was added since the last call.
+ The edges added since the last call (e.g. by the release of pixels into a solved graph) are
+ appended: the list of each vertex they start from is moved to the end of arcs, followed by its
+ new edges, so that the cost is proportional to the new edges and to the degrees of their
+ vertices. All the lists are sorted again once the moved ones left half of arcs unused.
+*/
+template <class TWeight, class TIndex, class TCap>
+void GCGraph<TWeight, TIndex, TCap>::finalize()
+{
+	if (finalized())
+		return;
+	TIndex vtxCount = (TIndex)vtcs.size(), edgeCount = (TIndex)edges.size();
+	if (!lists.empty() && 2 * unusedArcs <= (TIndex)arcs.size())
+	{
+		// new edges, by source vertex
+		std::vector<std::pair<TIndex, TIndex> > added;
+		added.reserve(edgeCount - listedEdges);
+		for (TIndex e = listedEdges; e < edgeCount; e++)
+			added.push_back(std::make_pair(edges[e ^ 1].dst, e));
+		std::sort(added.begin(), added.end());
+
+		ArcList empty;
+		empty.begin = empty.end = 0;
+		lists.resize(vtxCount, empty);
+		for (size_t k = 0; k < added.size(); )
+		{
+			ArcList& list = lists[added[k].first];
+			TIndex begin = (TIndex)arcs.size();
+			for (TIndex a = list.begin; a < list.end; a++)
+			{
+				Arc arc = arcs[a];
+				arcs.push_back(arc);
+			}
+			unusedArcs += list.end - list.begin;
+			TIndex i = added[k].first;
+			for (; k < added.size() && added[k].first == i; k++)
+			{
+				Arc arc;
+				arc.dst = edges[added[k].second].dst;
+				arc.e = added[k].second;
+				arcs.push_back(arc);
+			}
+			list.begin = begin;
+			list.end = (TIndex)arcs.size();
+		}
+		listedEdges = std::max(edgeCount, (TIndex)2);
+		return;
+	}
+
+	// counting sort of the edges by source vertex, lists[i].begin moving from the start of the
+	// list of i to its end
+	ArcList empty;
+	empty.begin = empty.end = 0;
+	lists.assign(vtxCount, empty);
+	arcs.resize(std::max(edgeCount - 2, (TIndex)0));
+	for (TIndex e = 2; e < edgeCount; e++)
+		lists[edges[e ^ 1].dst].end++;
+	for (TIndex i = 0, a = 0; i < vtxCount; i++)
+	{
+		lists[i].begin = a;
+		a += lists[i].end;
+		lists[i].end = lists[i].begin;
+	}
+	for (TIndex e = edgeCount - 1; e >= 2; e--)
+	{
+		Arc& arc = arcs[lists[edges[e ^ 1].dst].end++];
+		arc.dst = edges[e].dst;
+		arc.e = e;
+	}
+	listedEdges = std::max(edgeCount, (TIndex)2);
+	unusedArcs = 0;
+}
+
+template <class TWeight, class TIndex, class TCap>
+void GCGraph<TWeight, TIndex, TCap>::addTermWeights(TIndex i, TWeight sourceW, TWeight sinkW)
+{
+	CV_Assert(i >= 0 && i < (TIndex)vtcs.size());
+
+	sourceW = units(sourceW);
+	sinkW = units(sinkW);
 	TWeight dw = vtcs[i].weight;
 	if (dw > 0)
 		sourceW += dw;
@@ -166,163 +943,189 @@ void GCGraph<TWeight>::addTermWeights(int i, TWeight sourceW, TWeight sinkW)
 	vtcs[i].weight = sourceW - sinkW;  // don't modify
 }
 
+/*
+ Keep the vertices and edges of the graph, and cancel the flow. All the capacities must then
+ be rewritten with setTermWeights and setEdgeWeights before the next call of maxFlow, e.g.
+ when the graph is reused for new weights. As they modify distinct vertices or edges,
+ these calls can be made in parallel.
+*/
+template <class TWeight, class TIndex, class TCap>
+void GCGraph<TWeight, TIndex, TCap>::resetFlow()
+{
+	flow = 0;
+	changedVtcs.clear();
+}
+
+/*
+ Set the capacities of the edge e returned by addEdges, and of its reverse edge
+*/
+template <class TWeight, class TIndex, class TCap>
+void GCGraph<TWeight, TIndex, TCap>::setEdgeWeights(TIndex e, TWeight w, TWeight revw)
+{
+	CV_Assert(e >= 2 && e < (TIndex)edges.size() && w >= 0 && revw >= 0);
+	setPair(e, w, revw);
+}
+
+/*
+ Set the t-weights of vertex i. Unlike addTermWeights, the flow is not modified: the part
+ min(sourceW, sinkW), which is cut whatever the segmentation, is left to the caller.
+*/
+template <class TWeight, class TIndex, class TCap>
+void GCGraph<TWeight, TIndex, TCap>::setTermWeights(TIndex i, TWeight sourceW, TWeight sinkW)
+{
+	CV_Assert(i >= 0 && i < (TIndex)vtcs.size());
+	vtcs[i].weight = units(sourceW) - units(sinkW);
+}
+
+/*
+ Dynamic graph cuts (Kohli and Torr).
+ Adds dSourceW and dSinkW, which may be negative, to the terminal capacities of vertex i
+ of an already solved graph. As in addTermWeights, the residual capacities of the t-links
+ are reparameterized so that they stay non negative, the flow being corrected accordingly.
+ The vertex is recorded for the next call to maxFlow(true), which reuses the residual graph
+ and the search trees. Vertices added after a maxFlow call, with their edges, are handled the
+ same way as long as they are passed to updateTermWeights, possibly with null weights.
+*/
+template <class TWeight, class TIndex, class TCap>
+void GCGraph<TWeight, TIndex, TCap>::updateTermWeights(TIndex i, TWeight dSourceW, TWeight dSinkW)
+{
+	addTermWeights(i, dSourceW, dSinkW);
+	changedVtcs.push_back(i);
+}
+
 /*
 MinCut-MaxFlow Boykov-Kolmogoroff algorithm
 */
-template <class TWeight>
-TWeight GCGraph<TWeight>::maxFlow()
+template <class TWeight, class TIndex, class TCap>
+TWeight GCGraph<TWeight, TIndex, TCap>::maxFlow()
 {
-	const int TERMINAL = -1, ORPHAN = -2;
-	Vtx stub, *nilNode = &stub, *first = nilNode, *last = nilNode;
-	int curr_ts = 0;
-	stub.next = nilNode;
-	Vtx *vtxPtr = &vtcs[0];
-	Edge *edgePtr = &edges[0];
+	return maxFlow(false);
+}
 
-	std::vector<Vtx*> orphans;
+/*
+ With reuseTrees, the search trees and the residual graph of the previous call are kept
+ (dynamic graph cuts, Kohli and Torr): only the vertices modified by updateTermWeights
+ are processed to restore valid trees before the search resumes.
+*/
+template <class TWeight, class TIndex, class TCap>
+TWeight GCGraph<TWeight, TIndex, TCap>::maxFlow(bool reuseTrees)
+{
+	const TIndex TERMINAL = -1, ORPHAN = -2;
+	finalize();
+	TIndex first = -1, last = -1; // active queue, see pushActive
+	Vtx *vtxPtr = vtcs.data();
+	Edge *edgePtr = edges.data();
+	Pair *pairPtr = pairs.data();
+	const Arc *arcPtr = arcs.data();
+	const ArcList *listPtr = lists.data();
 
-	// initialize the active queue and the graph vertices
-	for (int i = 0; i < (int)vtcs.size(); i++)
+	std::vector<TIndex>& orphans = orphanStack;
+	orphans.clear();
+
+	if (!reuseTrees)
 	{
-		Vtx* v = vtxPtr + i;
-		v->ts = 0;
-		if (v->weight != 0)
+		// initialize the active queue and the graph vertices
+		curr_ts = 0;
+		for (TIndex i = 0; i < (TIndex)vtcs.size(); i++)
 		{
-			last = last->next = v;
-			v->dist = 1;
-			v->parent = TERMINAL;
-			v->t = v->weight < 0;
+			Vtx* v = vtxPtr + i;
+			v->ts = 0;
+			v->next = 0;
+			if (v->weight != 0)
+			{
+				pushActive(vtxPtr, v, first, last);
+				v->dist = 1;
+				v->parent = TERMINAL;
+				v->t = v->weight < 0;
+			}
+			else
+				v->parent = 0;
 		}
-		else
-			v->parent = 0;
 	}
-
-	first = first->next;
-	last->next = nilNode;
-	nilNode->next = 0;
-
-	// run the search-path -> augment-graph -> restore-trees loop
-	for (;;)
+	else
 	{
-		Vtx* v, *u;
-		int e0 = -1, ei = 0, ej = 0;
-		TWeight minWeight, weight;
-		uchar vt;
-
-		// grow S & T search trees, find an edge connecting them
-		while (first != nilNode)
+		// restore the search trees around the modified vertices
+		curr_ts++;
+		for (size_t k = 0; k < changedVtcs.size(); k++)
 		{
-			v = first;
-			if (v->parent)
+			Vtx* v = vtxPtr + changedVtcs[k];
+			uchar t = v->weight < 0;
+			if (!v->parent || (v->weight != 0 && v->t != t))
 			{
-				vt = v->t;
-				for (ei = v->first; ei != 0; ei = edgePtr[ei].next)
+				// the vertex is free (or new), or moves to the other tree: its children become
+				// orphans, and its neighbors are activated, as it may be freed before being scanned
+				for (TIndex a = listPtr[v - vtxPtr].begin, aEnd = listPtr[v - vtxPtr].end; a < aEnd; a++)
 				{
-					if (edgePtr[ei^vt].weight == 0)
-						continue;
-					u = vtxPtr + edgePtr[ei].dst;
-					if (!u->parent)
+					Vtx* u = vtxPtr + arcPtr[a].dst;
+					if (v->parent && u->t == v->t && u->parent > 0 && vtxPtr + edgePtr[u->parent].dst == v)
 					{
-						u->t = vt;
-						u->parent = ei ^ 1;
-						u->ts = v->ts;
-						u->dist = v->dist + 1;
-						if (!u->next)
-						{
-							u->next = nilNode;
-							last = last->next = u;
-						}
-						continue;
+						orphans.push_back((TIndex)(u - vtxPtr));
+						u->parent = ORPHAN;
 					}
-
-					if (u->t != vt)
+					else if (u->parent && !u->next)
 					{
-						e0 = ei ^ vt;
-						break;
-					}
-
-					if (u->dist > v->dist + 1 && u->ts <= v->ts)
-					{
-						// reassign the parent
-						u->parent = ei ^ 1;
-						u->ts = v->ts;
-						u->dist = v->dist + 1;
+						pushActive(vtxPtr, u, first, last);
 					}
 				}
-				if (e0 > 0)
-					break;
 			}
-			// exclude the vertex from the active list
-			first = first->next;
-			v->next = 0;
-		}
-
-		if (e0 <= 0)
-			break;
-
-		// find the minimum edge weight along the path
-		minWeight = edgePtr[e0].weight;
-		CV_Assert(minWeight > 0);
-		// k = 1: source tree, k = 0: destination tree
-		for (int k = 1; k >= 0; k--)
-		{
-			for (v = vtxPtr + edgePtr[e0^k].dst;; v = vtxPtr + edgePtr[ei].dst)
-			{
-				if ((ei = v->parent) < 0)
-					break;
-				weight = edgePtr[ei^k].weight;
-				minWeight = MIN(minWeight, weight);
-				CV_Assert(minWeight > 0);
-			}
-			weight = fabs(v->weight);
-			minWeight = MIN(minWeight, weight);
-			CV_Assert(minWeight > 0);
-		}
-
-		// modify weights of the edges along the path and collect orphans
-		edgePtr[e0].weight -= minWeight;
-		edgePtr[e0 ^ 1].weight += minWeight;
-		flow += minWeight;
-
-		// k = 1: source tree, k = 0: destination tree
-		for (int k = 1; k >= 0; k--)
-		{
-			for (v = vtxPtr + edgePtr[e0^k].dst;; v = vtxPtr + edgePtr[ei].dst)
+			if (v->weight != 0)
 			{
-				if ((ei = v->parent) < 0)
-					break;
-				edgePtr[ei ^ (k ^ 1)].weight += minWeight;
-				if ((edgePtr[ei^k].weight -= minWeight) == 0)
+				v->parent = TERMINAL;
+				v->t = t;
+				v->ts = curr_ts;
+				v->dist = 1;
+				if (!v->next)
 				{
-					orphans.push_back(v);
-					v->parent = ORPHAN;
+					pushActive(vtxPtr, v, first, last);
 				}
 			}
-
-			v->weight = v->weight + minWeight*(1 - k * 2);
-			if (v->weight == 0)
+			else if (v->parent == TERMINAL)
 			{
-				orphans.push_back(v);
+				// the vertex lost its t-link
+				orphans.push_back((TIndex)(v - vtxPtr));
 				v->parent = ORPHAN;
 			}
 		}
+		// keep the orphans in the active queue, so it is not empty when they are adopted
+		for (size_t k = 0; k < orphans.size(); k++)
+		{
+			Vtx* v = vtxPtr + orphans[k];
+			if (!v->next)
+			{
+				pushActive(vtxPtr, v, first, last);
+			}
+		}
+	}
+	changedVtcs.clear();
+
+
+	// run the restore-trees -> search-path -> augment-graph loop
+	for (;;)
+	{
+		Vtx* v, *u;
+		TIndex e0 = -1, ei = 0, ej = 0;
+		TWeight minWeight, weight;
+		uchar vt;
 
 		// restore the search trees by finding new parents for the orphans
 		curr_ts++;
 		while (!orphans.empty())
 		{
-			Vtx* v2 = orphans.back();
+			Vtx* v2 = vtxPtr + orphans.back();
 			orphans.pop_back();
+			if (v2->parent != ORPHAN)
+				continue; // a modified vertex, back to a root
 
 			int d, minDist = INT_MAX;
 			e0 = 0;
 			vt = v2->t;
 
-			for (ei = v2->first; ei != 0; ei = edgePtr[ei].next)
+			for (TIndex a = listPtr[v2 - vtxPtr].begin, aEnd = listPtr[v2 - vtxPtr].end; a < aEnd; a++)
 			{
-				if (edgePtr[ei ^ (vt ^ 1)].weight == 0)
+				ei = arcPtr[a].e;
+				if (residual(pairPtr, ei ^ (vt ^ 1)) == 0)
 					continue;
-				u = vtxPtr + edgePtr[ei].dst;
+				u = vtxPtr + arcPtr[a].dst;
 				if (u->t != vt || u->parent == 0)
 					continue;
 				// compute the distance to the tree root
@@ -357,7 +1160,7 @@ TWeight GCGraph<TWeight>::maxFlow()
 						minDist = d;
 						e0 = ei;
 					}
-					for (u = vtxPtr + edgePtr[ei].dst; u->ts != curr_ts; u = vtxPtr + edgePtr[u->parent].dst)
+					for (u = vtxPtr + arcPtr[a].dst; u->ts != curr_ts; u = vtxPtr + edgePtr[u->parent].dst)
 					{
 						u->ts = curr_ts;
 						u->dist = --d;
@@ -374,26 +1177,123 @@ TWeight GCGraph<TWeight>::maxFlow()
 
 			/* no parent is found */
 			v2->ts = 0;
-			for (ei = v2->first; ei != 0; ei = edgePtr[ei].next)
+			for (TIndex a = listPtr[v2 - vtxPtr].begin, aEnd = listPtr[v2 - vtxPtr].end; a < aEnd; a++)
 			{
-				u = vtxPtr + edgePtr[ei].dst;
+				ei = arcPtr[a].e;
+				u = vtxPtr + arcPtr[a].dst;
 				ej = u->parent;
 				if (u->t != vt || !ej)
 					continue;
-				if (edgePtr[ei ^ (vt ^ 1)].weight && !u->next)
+				if (residual(pairPtr, ei ^ (vt ^ 1)) != 0 && !u->next)
 				{
-					u->next = nilNode;
-					last = last->next = u;
+					pushActive(vtxPtr, u, first, last);
 				}
 				if (ej > 0 && vtxPtr + edgePtr[ej].dst == v2)
 				{
-					orphans.push_back(u);
+					orphans.push_back((TIndex)(u - vtxPtr));
 					u->parent = ORPHAN;
 				}
 			}
 		}
+		e0 = -1;
+		ei = 0;
+
+		// grow S & T search trees, find an edge connecting them
+		while (first >= 0)
+		{
+			v = vtxPtr + first;
+			if (v->parent)
+			{
+				vt = v->t;
+				for (TIndex a = listPtr[v - vtxPtr].begin, aEnd = listPtr[v - vtxPtr].end; a < aEnd; a++)
+				{
+					ei = arcPtr[a].e;
+					if (residual(pairPtr, ei^vt) == 0)
+						continue;
+					u = vtxPtr + arcPtr[a].dst;
+					if (!u->parent)
+					{
+						u->t = vt;
+						u->parent = ei ^ 1;
+						u->ts = v->ts;
+						u->dist = v->dist + 1;
+						if (!u->next)
+						{
+							pushActive(vtxPtr, u, first, last);
+						}
+						continue;
+					}
+
+					if (u->t != vt)
+					{
+						e0 = ei ^ vt;
+						break;
+					}
+
+					if (u->dist > v->dist + 1 && u->ts <= v->ts)
+					{
+						// reassign the parent
+						u->parent = ei ^ 1;
+						u->ts = v->ts;
+						u->dist = v->dist + 1;
+					}
+				}
+				if (e0 > 0)
+					break;
+			}
+			// exclude the vertex from the active list
+			popActive(v, first, last);
+		}
+
+		if (e0 <= 0)
+			break;
+
+		// find the minimum edge weight along the path
+		minWeight = residual(pairPtr, e0);
+		CV_Assert(minWeight > 0);
+		// k = 1: source tree, k = 0: destination tree
+		for (int k = 1; k >= 0; k--)
+		{
+			for (v = vtxPtr + edgePtr[e0^k].dst;; v = vtxPtr + edgePtr[ei].dst)
+			{
+				if ((ei = v->parent) < 0)
+					break;
+				weight = residual(pairPtr, ei^k);
+				minWeight = MIN(minWeight, weight);
+				CV_Assert(minWeight > 0);
+			}
+			weight = fabs(v->weight);
+			minWeight = MIN(minWeight, weight);
+			CV_Assert(minWeight > 0);
+		}
+
+		// modify weights of the edges along the path and collect orphans
+		augment(pairPtr, e0, minWeight);
+		flow += minWeight;
+
+		// k = 1: source tree, k = 0: destination tree
+		for (int k = 1; k >= 0; k--)
+		{
+			for (v = vtxPtr + edgePtr[e0^k].dst;; v = vtxPtr + edgePtr[ei].dst)
+			{
+				if ((ei = v->parent) < 0)
+					break;
+				if (augment(pairPtr, ei^k, minWeight) == 0)
+				{
+					orphans.push_back((TIndex)(v - vtxPtr));
+					v->parent = ORPHAN;
+				}
+			}
+
+			v->weight = v->weight + minWeight*(1 - k * 2);
+			if (v->weight == 0)
+			{
+				orphans.push_back((TIndex)(v - vtxPtr));
+				v->parent = ORPHAN;
+			}
+		}
 	}
-	return flow;
+	return toWeight(flow);
 }
 
 /*
@@ -402,35 +1302,42 @@ TWeight GCGraph<TWeight>::maxFlow()
  Graph vertices v are splitted into disjoint regions.
  Max flow is computed on the subgraph corresponding to a region.
  As subgraphs are disjoint, all the computations can be done in parallel without any synchronization. 
- Addition of the partial flows and a last execution of maxFlow on the entire residual graph
- achieve the computation. 
+ The partial flow of the region is returned, and added to the flow of the graph: a last execution
+ of maxFlow on the entire residual graph achieves the computation and returns the total flow, and
+ so do the warm-started calls that follow.
 */
-template <class TWeight>
-TWeight GCGraph<TWeight>::maxFlow(int reg, const int reg_flag)
+template <class TWeight, class TIndex, class TCap>
+TWeight GCGraph<TWeight, TIndex, TCap>::maxFlow(int reg, const int reg_flag)
 {
-	const int TERMINAL = -1, ORPHAN = -2;
-	Vtx stub, *nilNode = &stub, *first = nilNode, *last = nilNode;
+	const TIndex TERMINAL = -1, ORPHAN = -2;
+	CV_Assert(finalized()); // finalize modifies the graph, it cannot run for the regions in parallel
+	TIndex first = -1, last = -1; // active queue, see pushActive
 	int curr_ts = 0;
-	stub.next = nilNode;
-	Vtx *vtxPtr = &vtcs[0];
-	Edge *edgePtr = &edges[0];
+	Vtx *vtxPtr = vtcs.data();
+	Edge *edgePtr = edges.data();
+	Pair *pairPtr = pairs.data();
+	const Arc *arcPtr = arcs.data();
+	const ArcList *listPtr = lists.data();
 
-	int count = 0;
-	std::vector<Vtx*> orphans;
+	// a region without vertices has no stack
+	std::vector<TIndex> noOrphans;
+	std::vector<TIndex>& orphans = reg < (int)regionOrphanStacks.size() ? regionOrphanStacks[reg] : noOrphans;
+	orphans.clear();
 
 	// to enable concurrent writings we override graph.flow with a local variable
 	TWeight flow = 0;
 
 	// initialize the active queue and the graph vertices
-	for (int i = 0; i < (int)vtcs.size(); i++)
+	for (TIndex i = 0; i < (TIndex)vtcs.size(); i++)
 	{
 		Vtx* v = vtxPtr + i;
 		if (v->region[reg_flag] != reg)
 			continue;
 		v->ts = 0;
+		v->next = 0;
 		if (v->weight != 0)
 		{
-			last = last->next = v;
+			pushActive(vtxPtr, v, first, last);
 			v->dist = 1;
 			v->parent = TERMINAL;
 			v->t = v->weight < 0;
@@ -439,33 +1346,30 @@ TWeight GCGraph<TWeight>::maxFlow(int reg, const int reg_flag)
 			v->parent = 0;
 	}
 
-	first = first->next;
-	last->next = nilNode;
-	nilNode->next = 0;
 
 	// run the search-path -> augment-graph -> restore-trees loop
 	for (;;)
 	{
-		count++;
 		Vtx* v, *u;
-		int e0 = -1, ei = 0, ej = 0;
+		TIndex e0 = -1, ei = 0, ej = 0;
 		TWeight minWeight, weight;
 		uchar vt;
 
 		// grow S & T search trees, find an edge connecting them
-		while (first != nilNode)
+		while (first >= 0)
 		{
-			v = first;
+			v = vtxPtr + first;
 			if (v->parent)
 			{
 				vt = v->t;
-				for (ei = v->first; ei != 0; ei = edgePtr[ei].next)
+				for (TIndex a = listPtr[v - vtxPtr].begin, aEnd = listPtr[v - vtxPtr].end; a < aEnd; a++)
 				{
-					if (edgePtr[ei^vt].weight == 0)
+					ei = arcPtr[a].e;
+					if (residual(pairPtr, ei^vt) == 0)
 						continue;
-					if ((vtxPtr + edgePtr[ei].dst)->region[reg_flag] != reg)
+					if ((vtxPtr + arcPtr[a].dst)->region[reg_flag] != reg)
 						continue;
-					u = vtxPtr + edgePtr[ei].dst;
+					u = vtxPtr + arcPtr[a].dst;
 					if (!u->parent)
 					{
 						u->t = vt;
@@ -474,8 +1378,7 @@ TWeight GCGraph<TWeight>::maxFlow(int reg, const int reg_flag)
 						u->dist = v->dist + 1;
 						if (!u->next)
 						{
-							u->next = nilNode;
-							last = last->next = u;
+							pushActive(vtxPtr, u, first, last);
 						}
 						continue;
 					}
@@ -498,15 +1401,14 @@ TWeight GCGraph<TWeight>::maxFlow(int reg, const int reg_flag)
 					break;
 			}
 			// exclude the vertex from the active list
-			first = first->next;
-			v->next = 0;
+			popActive(v, first, last);
 		}
 
 		if (e0 <= 0)
 			break;
 
 		// find the minimum edge weight along the path
-		minWeight = edgePtr[e0].weight;
+		minWeight = residual(pairPtr, e0);
 		CV_Assert(minWeight > 0);
 		// k = 1: source tree, k = 0: destination tree
 		for (int k = 1; k >= 0; k--)
@@ -515,8 +1417,8 @@ TWeight GCGraph<TWeight>::maxFlow(int reg, const int reg_flag)
 			{
 				if ((ei = v->parent) < 0)
 					break;
-				weight = edgePtr[ei^k].weight;
-				CV_Assert(v->region[reg_flag] == reg);   //TODO remove***********************************************
+				weight = residual(pairPtr, ei^k);
+				CV_DbgAssert(v->region[reg_flag] == reg);
 				minWeight = MIN(minWeight, weight);
 				CV_Assert(minWeight > 0);
 			}
@@ -526,8 +1428,7 @@ TWeight GCGraph<TWeight>::maxFlow(int reg, const int reg_flag)
 		}
 
 		// modify weights of the edges along the path and collect orphans
-		edgePtr[e0].weight -= minWeight;
-		edgePtr[e0 ^ 1].weight += minWeight;
+		augment(pairPtr, e0, minWeight);
 		flow += minWeight;
 
 		// k = 1: source tree, k = 0: destination tree
@@ -537,19 +1438,18 @@ TWeight GCGraph<TWeight>::maxFlow(int reg, const int reg_flag)
 			{
 				if ((ei = v->parent) < 0)
 					break;
-				edgePtr[ei ^ (k ^ 1)].weight += minWeight;
-				if ((edgePtr[ei^k].weight -= minWeight) == 0)
+				if (augment(pairPtr, ei^k, minWeight) == 0)
 				{
-					orphans.push_back(v);
+					orphans.push_back((TIndex)(v - vtxPtr));
 					v->parent = ORPHAN;
 				}
-				CV_Assert(v->region[reg_flag] == reg);   //TODO remove***********************************************
+				CV_DbgAssert(v->region[reg_flag] == reg);
 			}
 
 			v->weight = v->weight + minWeight*(1 - k * 2);
 			if (v->weight == 0)
 			{
-				orphans.push_back(v);
+				orphans.push_back((TIndex)(v - vtxPtr));
 				v->parent = ORPHAN;
 			}
 		}
@@ -558,18 +1458,19 @@ TWeight GCGraph<TWeight>::maxFlow(int reg, const int reg_flag)
 		curr_ts++;
 		while (!orphans.empty())
 		{
-			Vtx* v2 = orphans.back();
+			Vtx* v2 = vtxPtr + orphans.back();
 			orphans.pop_back();
 
 			int d, minDist = INT_MAX;
 			e0 = 0;
 			vt = v2->t;
 
-			for (ei = v2->first; ei != 0; ei = edgePtr[ei].next)
+			for (TIndex a = listPtr[v2 - vtxPtr].begin, aEnd = listPtr[v2 - vtxPtr].end; a < aEnd; a++)
 			{
-				if ((edgePtr[ei ^ (vt ^ 1)].weight == 0) || ((vtxPtr + edgePtr[ei].dst)->region[reg_flag] != reg))
+				ei = arcPtr[a].e;
+				if ((residual(pairPtr, ei ^ (vt ^ 1)) == 0) || ((vtxPtr + arcPtr[a].dst)->region[reg_flag] != reg))
 					continue;
-				u = vtxPtr + edgePtr[ei].dst;
+				u = vtxPtr + arcPtr[a].dst;
 				if (u->t != vt || u->parent == 0)
 					continue;
 				// compute the distance to the tree root
@@ -604,7 +1505,7 @@ TWeight GCGraph<TWeight>::maxFlow(int reg, const int reg_flag)
 						minDist = d;
 						e0 = ei;
 					}
-					for (u = vtxPtr + edgePtr[ei].dst; u->ts != curr_ts; u = vtxPtr + edgePtr[u->parent].dst)
+					for (u = vtxPtr + arcPtr[a].dst; u->ts != curr_ts; u = vtxPtr + edgePtr[u->parent].dst)
 					{
 						u->ts = curr_ts;
 						u->dist = --d;
@@ -621,36 +1522,39 @@ TWeight GCGraph<TWeight>::maxFlow(int reg, const int reg_flag)
 
 			/* no parent is found */
 			v2->ts = 0;
-			for (ei = v2->first; ei != 0; ei = edgePtr[ei].next)
+			for (TIndex a = listPtr[v2 - vtxPtr].begin, aEnd = listPtr[v2 - vtxPtr].end; a < aEnd; a++)
 			{
-				u = vtxPtr + edgePtr[ei].dst;
+				ei = arcPtr[a].e;
+				u = vtxPtr + arcPtr[a].dst;
 				if (u->region[reg_flag] != reg)
 					continue;
 				ej = u->parent;
 				if (u->t != vt || !ej)
 					continue;
-				if (edgePtr[ei ^ (vt ^ 1)].weight && !u->next)
+				if (residual(pairPtr, ei ^ (vt ^ 1)) != 0 && !u->next)
 				{
-					u->next = nilNode;
-					last = last->next = u;
+					pushActive(vtxPtr, u, first, last);
 				}
 				if (ej > 0 && vtxPtr + edgePtr[ej].dst == v2)
 				{
-					orphans.push_back(u);
+					orphans.push_back((TIndex)(u - vtxPtr));
 					u->parent = ORPHAN;
-					CV_Assert(u->region[reg_flag] == reg);   //TODO remove***********************************************
+					CV_DbgAssert(u->region[reg_flag] == reg);
 				}
 			}
 		}
 	}
-	//printf("region %d, iter %d\n", r, count);
-	return flow;
+	{
+		std::lock_guard<std::mutex> lk(regionMtx);
+		this->flow += flow;
+	}
+	return toWeight(flow);
 }
 
-template <class TWeight>
-inline bool GCGraph<TWeight>::inSourceSegment(int i)
+template <class TWeight, class TIndex, class TCap>
+inline bool GCGraph<TWeight, TIndex, TCap>::inSourceSegment(TIndex i)
 {
-	CV_Assert(i >= 0 && i<(int)vtcs.size());
+	CV_Assert(i >= 0 && i < (TIndex)vtcs.size());
 	return vtcs[i].t == 0;
 }
 
@@ -45,6 +45,22 @@
 #include <time.h>
 #include <mutex>
 #include <thread>
+#include <functional>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <atomic>
+#if defined __linux__
+#include <sched.h>
+#endif
+#if defined _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#elif defined __unix__ || defined __APPLE__
+#include <unistd.h>
+#endif
 
 using namespace cv;
 
@@ -55,12 +71,14 @@ Carsten Rother, Vladimir Kolmogorov, Andrew Blake.
  */
 
 /*
- GMM - Gaussian Mixture Model
+ GMM - Gaussian Mixture Model of K components. The models of the API (bgdModel, fgdModel) have
+ the layout of the default 5 components.
 */
+template <int K = 5>
 class GMM
 {
 public:
-    static const int componentsCount = 5;
+    static const int componentsCount = K;
 
     GMM( Mat& _model );
     double operator()( const Vec3d color ) const;
@@ -68,7 +86,8 @@ public:
     int whichComponent( const Vec3d color ) const;
 
     void initLearning();
-    void addSample( int ci, const Vec3d color );
+    void addSample( int ci, const Vec3d color, int weight = 1 );
+    void addSamples( int ci, const double sum[3], const double prod[3][3], int count );
     void endLearning();
 
 private:
@@ -83,11 +102,13 @@ private:
 
     double sums[componentsCount][3];
     double prods[componentsCount][3][3];
-    int sampleCounts[componentsCount];
-    int totalSampleCount;
+    // weighted counts: the context samples of the tiles stand for step*step pixels each
+    int64 sampleCounts[componentsCount];
+    int64 totalSampleCount;
 };
 
-GMM::GMM( Mat& _model )
+template <int K>
+GMM<K>::GMM( Mat& _model )
 {
     const int modelSize = 3/*mean*/ + 9/*covariance*/ + 1/*component weight*/;
     if( _model.empty() )
@@ -109,7 +130,8 @@ GMM::GMM( Mat& _model )
              calcInverseCovAndDeterm( ci );
 }
 
-double GMM::operator()( const Vec3d color ) const
+template <int K>
+double GMM<K>::operator()( const Vec3d color ) const
 {
     double res = 0;
     for( int ci = 0; ci < componentsCount; ci++ )
@@ -117,7 +139,8 @@ double GMM::operator()( const Vec3d color ) const
     return res;
 }
 
-double GMM::operator()( int ci, const Vec3d color ) const
+template <int K>
+double GMM<K>::operator()( int ci, const Vec3d color ) const
 {
     double res = 0;
     if( coefs[ci] > 0 )
@@ -134,7 +157,8 @@ double GMM::operator()( int ci, const Vec3d color ) const
     return res;
 }
 
-int GMM::whichComponent( const Vec3d color ) const
+template <int K>
+int GMM<K>::whichComponent( const Vec3d color ) const
 {
     int k = 0;
     double max = 0;
@@ -151,7 +175,8 @@ int GMM::whichComponent( const Vec3d color ) const
     return k;
 }
 
-void GMM::initLearning()
+template <int K>
+void GMM<K>::initLearning()
 {
     for( int ci = 0; ci < componentsCount; ci++)
     {
@@ -164,27 +189,51 @@ void GMM::initLearning()
     totalSampleCount = 0;
 }
 
-void GMM::addSample( int ci, const Vec3d color )
+/*
+  A sample of weight w counts as w samples of the same color.
+*/
+template <int K>
+void GMM<K>::addSample( int ci, const Vec3d color, int weight )
+{
+    Vec3d wcolor = color*(double)weight;
+    sums[ci][0] += wcolor[0]; sums[ci][1] += wcolor[1]; sums[ci][2] += wcolor[2];
+    prods[ci][0][0] += wcolor[0]*color[0]; prods[ci][0][1] += wcolor[0]*color[1]; prods[ci][0][2] += wcolor[0]*color[2];
+    prods[ci][1][0] += wcolor[1]*color[0]; prods[ci][1][1] += wcolor[1]*color[1]; prods[ci][1][2] += wcolor[1]*color[2];
+    prods[ci][2][0] += wcolor[2]*color[0]; prods[ci][2][1] += wcolor[2]*color[1]; prods[ci][2][2] += wcolor[2]*color[2];
+    CV_Assert( weight >= 0 && totalSampleCount <= std::numeric_limits<int64>::max() - weight );
+    sampleCounts[ci] += weight;
+    totalSampleCount += weight;
+}
+
+/*
+  Adds count samples given by the sum of their colors and the sum of the products of their colors.
+*/
+template <int K>
+void GMM<K>::addSamples( int ci, const double sum[3], const double prod[3][3], int count )
 {
-    sums[ci][0] += color[0]; sums[ci][1] += color[1]; sums[ci][2] += color[2];
-    prods[ci][0][0] += color[0]*color[0]; prods[ci][0][1] += color[0]*color[1]; prods[ci][0][2] += color[0]*color[2];
-    prods[ci][1][0] += color[1]*color[0]; prods[ci][1][1] += color[1]*color[1]; prods[ci][1][2] += color[1]*color[2];
-    prods[ci][2][0] += color[2]*color[0]; prods[ci][2][1] += color[2]*color[1]; prods[ci][2][2] += color[2]*color[2];
-    sampleCounts[ci]++;
-    totalSampleCount++;
+    for( int i = 0; i < 3; i++ )
+    {
+        sums[ci][i] += sum[i];
+        for( int j = 0; j < 3; j++ )
+            prods[ci][i][j] += prod[i][j];
+    }
+    CV_Assert( count >= 0 && totalSampleCount <= std::numeric_limits<int64>::max() - count );
+    sampleCounts[ci] += count;
+    totalSampleCount += count;
 }
 
-void GMM::endLearning()
+template <int K>
+void GMM<K>::endLearning()
 {
     const double variance = 0.01;
     for( int ci = 0; ci < componentsCount; ci++ )
     {
-        int n = sampleCounts[ci];
+        double n = (double)sampleCounts[ci];
         if( n == 0 )
             coefs[ci] = 0;
         else
         {
-            coefs[ci] = (double)n/totalSampleCount;
+            coefs[ci] = n/totalSampleCount;
 
             double* m = mean + 3*ci;
             m[0] = sums[ci][0]/n; m[1] = sums[ci][1]/n; m[2] = sums[ci][2]/n;
@@ -208,7 +257,8 @@ void GMM::endLearning()
     }
 }
 
-void GMM::calcInverseCovAndDeterm( int ci )
+template <int K>
+void GMM<K>::calcInverseCovAndDeterm( int ci )
 {
     if( coefs[ci] > 0 )
     {
@@ -229,36 +279,43 @@ void GMM::calcInverseCovAndDeterm( int ci )
     }
 }
 
+// 8-neighborhood: the n-weights of the 4 first neighbors are stored at the pixel,
+// those of the 4 last ones at the neighbor (e.g. right neighbor -> leftW of the neighbor).
+// The 4-neighborhood is made of the even ones, so the neighbors of a connectivity Conn
+// (4 or 8) are visited by the steps of 8 / Conn.
+static const int nbr_dx[8] = { -1, -1, 0, 1, 1, 1, 0, -1 };
+static const int nbr_dy[8] = { 0, -1, -1, -1, 0, 1, 1, 1 };
+
+/*
+  Number of pairs of neighbors of an image of size sz, for the connectivity 4 or 8.
+*/
+static inline int64 nbrPairCount( Size sz, int connectivity )
+{
+    int64 w = sz.width, h = sz.height;
+    int64 count = 2*w*h - w - h; // left and up
+    return connectivity == 8 ? 2*count - w - h + 2 : count;
+}
+
 /*
   Calculate beta - parameter of GrabCut algorithm.
-  beta = 1/(2*avg(sqr(||color[i] - color[j]||)))
+  beta = 1/(2*avg(sqr(||color[i] - color[j]||))), over the pairs of neighbors of the
+  connectivity Conn. Each neighbor direction is summed on the pixels which have it,
+  so the loops need no bounds check.
 */
+template <int Conn>
 static double calcBeta( const Mat& img )
 {
     double beta = 0;
-    for( int y = 0; y < img.rows; y++ )
+    for( int k = 0; k < 4; k += 8 / Conn )
     {
-        for( int x = 0; x < img.cols; x++ )
+        const int dx = nbr_dx[k], dy = nbr_dy[k];
+        for( int y = -dy; y < img.rows; y++ )
         {
-            Vec3d color = img.at<Vec3b>(y,x);
-            if( x>0 ) // left
-            {
-                Vec3d diff = color - (Vec3d)img.at<Vec3b>(y,x-1);
-                beta += diff.dot(diff);
-            }
-            if( y>0 && x>0 ) // upleft
-            {
-                Vec3d diff = color - (Vec3d)img.at<Vec3b>(y-1,x-1);
-                beta += diff.dot(diff);
-            }
-            if( y>0 ) // up
-            {
-                Vec3d diff = color - (Vec3d)img.at<Vec3b>(y-1,x);
-                beta += diff.dot(diff);
-            }
-            if( y>0 && x<img.cols-1) // upright
+            const Vec3b* row = img.ptr<Vec3b>(y);
+            const Vec3b* nrow = img.ptr<Vec3b>(y + dy);
+            for( int x = std::max(-dx, 0); x < img.cols - std::max(dx, 0); x++ )
             {
-                Vec3d diff = color - (Vec3d)img.at<Vec3b>(y-1,x+1);
+                Vec3d diff = (Vec3d)row[x] - (Vec3d)nrow[x + dx];
                 beta += diff.dot(diff);
             }
         }
@@ -266,7 +323,7 @@ static double calcBeta( const Mat& img )
     if( beta <= std::numeric_limits<double>::epsilon() )
         beta = 0;
     else
-        beta = 1.f / (2 * beta/(4*img.cols*img.rows - 3*img.cols - 3*img.rows + 2) );
+        beta = 1.f / (2 * beta/(double)nbrPairCount(img.size(), Conn) );
 
     return beta;
 }
@@ -274,51 +331,56 @@ static double calcBeta( const Mat& img )
 /*
   Calculate weights of noterminal vertices of graph.
   beta and gamma - parameters of GrabCut algorithm.
+  The weights of the pairs which are not neighbors for the connectivity Conn, or which leave
+  the image, are 0: the diagonal ones with the 4-connectivity.
  */
+template <int Conn>
 static void calcNWeights( const Mat& img, Mat& leftW, Mat& upleftW, Mat& upW, Mat& uprightW, double beta, double gamma )
 {
     const double gammaDivSqrt2 = gamma / std::sqrt(2.0f);
-    leftW.create( img.rows, img.cols, CV_64FC1 );
-    upleftW.create( img.rows, img.cols, CV_64FC1 );
-    upW.create( img.rows, img.cols, CV_64FC1 );
-    uprightW.create( img.rows, img.cols, CV_64FC1 );
-    for( int y = 0; y < img.rows; y++ )
+    Mat* nW[4] = { &leftW, &upleftW, &upW, &uprightW };
+    for( int k = 0; k < 4; k++ )
+    {
+        nW[k]->create( img.rows, img.cols, CV_64FC1 );
+        nW[k]->setTo( Scalar::all(0) );
+    }
+    for( int k = 0; k < 4; k += 8 / Conn )
     {
-        for( int x = 0; x < img.cols; x++ )
+        const int dx = nbr_dx[k], dy = nbr_dy[k];
+        const double w = (dx != 0 && dy != 0) ? gammaDivSqrt2 : gamma;
+        for( int y = -dy; y < img.rows; y++ )
         {
-            Vec3d color = img.at<Vec3b>(y,x);
-            if( x-1>=0 ) // left
-            {
-                Vec3d diff = color - (Vec3d)img.at<Vec3b>(y,x-1);
-                leftW.at<double>(y,x) = gamma * exp(-beta*diff.dot(diff));
-            }
-            else
-                leftW.at<double>(y,x) = 0;
-            if( x-1>=0 && y-1>=0 ) // upleft
-            {
-                Vec3d diff = color - (Vec3d)img.at<Vec3b>(y-1,x-1);
-                upleftW.at<double>(y,x) = gammaDivSqrt2 * exp(-beta*diff.dot(diff));
-            }
-            else
-                upleftW.at<double>(y,x) = 0;
-            if( y-1>=0 ) // up
-            {
-                Vec3d diff = color - (Vec3d)img.at<Vec3b>(y-1,x);
-                upW.at<double>(y,x) = gamma * exp(-beta*diff.dot(diff));
-            }
-            else
-                upW.at<double>(y,x) = 0;
-            if( x+1<img.cols && y-1>=0 ) // upright
+            const Vec3b* row = img.ptr<Vec3b>(y);
+            const Vec3b* nrow = img.ptr<Vec3b>(y + dy);
+            double* wrow = nW[k]->ptr<double>(y);
+            for( int x = std::max(-dx, 0); x < img.cols - std::max(dx, 0); x++ )
             {
-                Vec3d diff = color - (Vec3d)img.at<Vec3b>(y-1,x+1);
-                uprightW.at<double>(y,x) = gammaDivSqrt2 * exp(-beta*diff.dot(diff));
+                Vec3d diff = (Vec3d)row[x] - (Vec3d)nrow[x + dx];
+                wrow[x] = w * exp(-beta*diff.dot(diff));
             }
-            else
-                uprightW.at<double>(y,x) = 0;
         }
     }
 }
 
+/*
+  calcBeta and calcNWeights for the connectivity 4 or 8 given at run time. Returns beta.
+ */
+static double calcBetaAndNWeights( const Mat& img, int connectivity, Mat& leftW, Mat& upleftW, Mat& upW, Mat& uprightW, double gamma )
+{
+    double beta;
+    if( connectivity == 4 )
+    {
+        beta = calcBeta<4>( img );
+        calcNWeights<4>( img, leftW, upleftW, upW, uprightW, beta, gamma );
+    }
+    else
+    {
+        beta = calcBeta<8>( img );
+        calcNWeights<8>( img, leftW, upleftW, upW, uprightW, beta, gamma );
+    }
+    return beta;
+}
+
 /*
   Check size, type and element values of mask matrix.
  */
@@ -361,7 +423,8 @@ static void initMaskWithRect( Mat& mask, Size imgSize, Rect rect )
 /*
   Initialize GMM background and foreground models using kmeans algorithm.
 */
-static void initGMMs( const Mat& img, const Mat& mask, GMM& bgdGMM, GMM& fgdGMM )
+template <int K>
+static void initGMMs( const Mat& img, const Mat& mask, GMM<K>& bgdGMM, GMM<K>& fgdGMM )
 {
     const int kMeansItCount = 10;
     const int kMeansType = KMEANS_PP_CENTERS;
@@ -381,10 +444,10 @@ static void initGMMs( const Mat& img, const Mat& mask, GMM& bgdGMM, GMM& fgdGMM
     }
     CV_Assert( !bgdSamples.empty() && !fgdSamples.empty() );
     Mat _bgdSamples( (int)bgdSamples.size(), 3, CV_32FC1, &bgdSamples[0][0] );
-    kmeans( _bgdSamples, GMM::componentsCount, bgdLabels,
+    kmeans( _bgdSamples, K, bgdLabels,
             TermCriteria( CV_TERMCRIT_ITER, kMeansItCount, 0.0), 0, kMeansType );
     Mat _fgdSamples( (int)fgdSamples.size(), 3, CV_32FC1, &fgdSamples[0][0] );
-    kmeans( _fgdSamples, GMM::componentsCount, fgdLabels,
+    kmeans( _fgdSamples, K, fgdLabels,
             TermCriteria( CV_TERMCRIT_ITER, kMeansItCount, 0.0), 0, kMeansType );
 
     bgdGMM.initLearning();
@@ -401,7 +464,8 @@ static void initGMMs( const Mat& img, const Mat& mask, GMM& bgdGMM, GMM& fgdGMM
 /*
   Assign GMMs components for each pixel.
 */
-static void assignGMMsComponents( const Mat& img, const Mat& mask, const GMM& bgdGMM, const GMM& fgdGMM, Mat& compIdxs )
+template <int K>
+static void assignGMMsComponents( const Mat& img, const Mat& mask, const GMM<K>& bgdGMM, const GMM<K>& fgdGMM, Mat& compIdxs )
 {
     Point p;
     for( p.y = 0; p.y < img.rows; p.y++ )
@@ -416,14 +480,16 @@ static void assignGMMsComponents( const Mat& img, const Mat& mask, const GMM& bg
 }
 
 /*
-  Learn GMMs parameters.
+  Learn GMMs parameters. When given, weights (CV_32SC1) holds the weight of each pixel.
 */
-static void learnGMMs( const Mat& img, const Mat& mask, const Mat& compIdxs, GMM& bgdGMM, GMM& fgdGMM )
+template <int K>
+static void learnGMMs( const Mat& img, const Mat& mask, const Mat& compIdxs, GMM<K>& bgdGMM, GMM<K>& fgdGMM,
+                       const Mat* weights = 0 )
 {
     bgdGMM.initLearning();
     fgdGMM.initLearning();
     Point p;
-    for( int ci = 0; ci < GMM::componentsCount; ci++ )
+    for( int ci = 0; ci < K; ci++ )
     {
         for( p.y = 0; p.y < img.rows; p.y++ )
         {
@@ -431,10 +497,11 @@ static void learnGMMs( const Mat& img, const Mat& mask, const Mat& compIdxs, GMM
             {
                 if( compIdxs.at<int>(p) == ci )
                 {
+                    int w = weights ? weights->at<int>(p) : 1;
                     if( mask.at<uchar>(p) == GC_BGD || mask.at<uchar>(p) == GC_PR_BGD )
-                        bgdGMM.addSample( ci, img.at<Vec3b>(p) );
+                        bgdGMM.addSample( ci, img.at<Vec3b>(p), w );
                     else
-                        fgdGMM.addSample( ci, img.at<Vec3b>(p) );
+                        fgdGMM.addSample( ci, img.at<Vec3b>(p), w );
                 }
             }
         }
@@ -444,561 +511,3229 @@ static void learnGMMs( const Mat& img, const Mat& mask, const Mat& compIdxs, GMM
 }
 
 /*
- multithread stuff 
-*/
-
-
-#define r_split 8
-
-// regions in image
-#define r_count r_split*r_split
-
-std::mutex m;
-
-// shared index for task queue
-int current_region = 0;
-
-static void worker(GCGraph<double> * graph, double * result, int f)
-{
-	int region;
-
-	for (;;)
-	{
-		std::unique_lock<std::mutex> lk(m);
-		region = current_region++;
-		lk.unlock();
-		if (region >= r_count)
-			break;
-		result[region] = graph->maxFlow(region, f);
-	}
-}
-
-
-
-/*
- Construct partially reduced GCGraph. 
- Pixels marked as BG or FG are merged with terminal nodes. The Mat pxl2Vtx 
- records the index of vertex for each pixel.
- To enable parallel computation of max Flow, the image is partitionned into
- regions, and each vertex is indexed by the corresponding region number.
+  Bounding box of the GC_PR_BGD and GC_PR_FGD pixels, with a ring of one pixel.
+  The pixels of the ring are marked as BG or FG, so the energy of the pixels inside the box
+  does not depend on the pixels outside of it. Returns an empty rect if there is no such pixel.
 */
-static void constructGCGraph_slim( const Mat& img, const Mat& mask, const GMM& bgdGMM, const GMM& fgdGMM, double lambda,
-                       const Mat& leftW, const Mat& upleftW, const Mat& upW, const Mat& uprightW,
-					   GCGraph<double>& graph, Mat& pxl2Vtx)
+static Rect uncertainROI( const Mat& mask )
 {
-    int vtxCount = img.cols*img.rows,
-        edgeCount = 2*(4*img.cols*img.rows - 3*(img.cols + img.rows) + 2);
-
-	// region numbering
-#define TRANS 200
-	//int h_size = (img.cols+TRANS) / r_split + 1, v_size = (img.rows + TRANS)/ r_split + 1;
-	int h_size = img.cols / r_split + 1, v_size = img.rows  / r_split + 1;
-
-	int r_split2 = r_split - 1;
-	int h_size2 = img.cols / r_split2 + 1, v_size2 = img.rows / r_split2 + 1;
-
-	std::vector<std::vector<int>> r_index(r_split, std::vector<int>(r_split));
-	std::vector<std::vector<int>> r_index2(r_split, std::vector<int>(r_split));
-
-	//quadtree(QT_HEIGHT, r_index);
-	for (int i = 0; i < r_split; i++)
-		for (int j = 0; j < r_split; j++)
-			r_index[i][j] = i*r_split + j;
-	
-	for (int i = 0; i < r_split2; i++)
-		for (int j = 0; j < r_split2; j++)
-			r_index2[i][j] = i*r_split2 + j;
-    graph.create(vtxCount, edgeCount);
-    Point p;
-	//int vtxIdx;
-
-    for( p.y = 0; p.y < img.rows; p.y++ )
+    int x0 = mask.cols, y0 = mask.rows, x1 = -1, y1 = -1;
+    for( int y = 0; y < mask.rows; y++ )
     {
-        for( p.x = 0; p.x < img.cols; p.x++)
-        {     
-            Vec3b color = img.at<Vec3b>(p);
-			
-            // add node and set its t-weights
-            double fromSource, toSink;
-            if( mask.at<uchar>(p) == GC_PR_BGD || mask.at<uchar>(p) == GC_PR_FGD )
-            {
-				int r = r_index[p.y / v_size][p.x / h_size];
-				int r1 = r_index[p.y / v_size][(p.x + TRANS) / h_size];
-				int r2 = r_index[(p.y + TRANS) / v_size][p.x / h_size];
-				int r3 = r_index[(p.y + TRANS) / v_size][(p.x + TRANS) / h_size];
-				int alt_r=r;
-				if (r != r1)
-					if (r == r2)
-						alt_r = r1;
-					else
-						alt_r = r3;
-				else
-					if (r != r2)
-						alt_r = r2;
-				alt_r = r_index[p.y / v_size2][p.x / h_size2];
-				int vtxIdx = graph.addVtx(r, alt_r);
-				pxl2Vtx.at<int>(p) = vtxIdx;
-				fromSource = -log(bgdGMM(color));
-				toSink = -log(fgdGMM(color));
-				graph.addTermWeights(vtxIdx, fromSource, toSink);
-            }
-            else if( mask.at<uchar>(p) == GC_BGD )
-			// join to sink
-            {
-				pxl2Vtx.at<int>(p) = GC_JNT_BGD; // join node to sink (BG) -1 = GC_JNT_BGD
-                //fromSource = 0;  // as fromSource=0, weight of edge(source, sink) is unmodified
-                //toSink = lambda; // edge deleted by the join operation
-            }
-            else
-			// join to source
-            {
-				pxl2Vtx.at<int>(p) = GC_JNT_FGD; // join node to source (FG) -2=GC_JNT_FGD
-                //fromSource = lambda; // edge deleted by the join operation
-                //toSink = 0; // as toSink=0, weight of edge(source, sink) is unmodified
-            }
-            
-			// Set n-weights and t-weights for non terminal neighbors
-			// Update t-weights for terminal neighbors.
-			int vtx = pxl2Vtx.at<int>(p); 
-			if (p.x > 0)
-			{
-				double w = leftW.at<double>(p);
-				int n = pxl2Vtx.at<int>(Point(p.x - 1, p.y)); // equiv to at<int>(p.y, p.x-1)
-				if (n >= 0)  // no terminal W-neighbor
-					if (vtx >= 0) // no terminal node
-						graph.addEdges(vtx, n, w, w);
-					else
-						graph.addTermWeights(n, (jfg(vtx) ? w : 0), (jbg(vtx) ? w : 0));
-				else
-					if (vtx >= 0)
-						graph.addTermWeights(vtx, (jfg(n) ? w : 0), (jbg(n) ? w : 0));
-					else
-						if (jbg(vtx) != jbg(n))
-							graph.sourceToSinkW += w;
-            }
-            if( p.x>0 && p.y>0 )
-            {
-                double w = upleftW.at<double>(p);
-				int n = pxl2Vtx.at<int>(Point(p.x - 1, p.y - 1));
-				if (n >= 0) // not terminal NW-neighbor
-					if (vtx >= 0) // not terminal node
-						graph.addEdges(vtx, n, w, w);
-					else
-						graph.addTermWeights(n, (jfg(vtx) ? w : 0), (jbg(vtx) ? w : 0));
-				else // neighbor is terminal
-					if (vtx >= 0)
-						graph.addTermWeights(vtx, (jfg(n) ? w : 0), (jbg(n) ? w : 0));
-					else
-						if (jbg(vtx) != jbg(n))
-							graph.sourceToSinkW += w;
-            }
-            if( p.y>0 )
-            {
-                double w = upW.at<double>(p);
-				int n = pxl2Vtx.at<int>(Point(p.x, p.y - 1));
-				if (n >= 0)
-					if (vtx >= 0)
-						graph.addEdges(vtx, n, w, w);
-					else
-						graph.addTermWeights(n, (jfg(vtx) ? w : 0), (jbg(vtx) ? w : 0));
-				else
-					if (vtx >= 0)
-					    graph.addTermWeights(vtx, (jfg(n) ? w : 0), (jbg(n) ? w : 0));
-					else
-						if (jbg(vtx) != jbg(n))
-							graph.sourceToSinkW += w;
-            }
-            if( p.x<img.cols-1 && p.y>0 )
+        const uchar* row = mask.ptr<uchar>(y);
+        for( int x = 0; x < mask.cols; x++ )
+        {
+            if( row[x] == GC_PR_BGD || row[x] == GC_PR_FGD )
             {
-                double w = uprightW.at<double>(p);
-				int n = pxl2Vtx.at<int>(Point(p.x + 1, p.y - 1));
-				if (n >= 0)
-					if (vtx >= 0)
-						graph.addEdges(vtx, n, w, w);
-					else
-						graph.addTermWeights(n, (jfg(vtx) ? w : 0), (jbg(vtx) ? w : 0));
-				else
-					if (vtx >= 0)
-					    graph.addTermWeights(vtx, (jfg(n) ? w : 0), (jbg(n) ? w : 0));
-					else
-						if (jbg(vtx) != jbg(n))
-							graph.sourceToSinkW += w;
+                x0 = std::min(x0, x); x1 = std::max(x1, x);
+                y0 = std::min(y0, y); y1 = std::max(y1, y);
             }
         }
     }
+    if( x1 < 0 )
+        return Rect();
+    x0 = std::max(x0 - 1, 0); y0 = std::max(y0 - 1, 0);
+    x1 = std::min(x1 + 1, mask.cols - 1); y1 = std::min(y1 + 1, mask.rows - 1);
+    return Rect(x0, y0, x1 - x0 + 1, y1 - y0 + 1);
 }
 
 /*
- Multithreaded estimateSegmentation with reduced graph
+  Gather the pixels on which the GMMs are learned when only roi is processed: the pixels of roi,
+  in row order, followed by a sample of the pixels outside of it, taken every step rows and
+  columns so that the sample is not larger than roi. The samples, their labels and their
+  weights (step*step outside of roi, so that the GMMs stay close to the ones learned on the
+  whole image) are stored in single row images, so that initGMMs, assignGMMsComponents and
+  learnGMMs apply to them.
+  The labels of the pixels of roi have to be updated with copyROILabels when the mask changes.
 */
-static double estimateSegmentation_slim( GCGraph<double>& graph, Mat& mask, const Mat& ptx2Vtx )
-{   
-	double flow = 0;
-
-	int n_thread = std::thread::hardware_concurrency();
-
-	double result[r_count];
-	//double * resultPtr = &result[0];
-
-	// launch parallel partial max flow computations
-	current_region = 0; 
-	std::vector<std::thread> pool;
-	
-	for (int j = 0; j < n_thread; j++)
-		pool.push_back(std::thread(worker, &graph, &result[0], 0));
-
-	for (auto& t : pool)
-		t.join();
-
-	for (int i = 0; i < r_count; i++)
-		flow += result[i];
-
-	pool.clear();
-	current_region = 0;
-		
-	for (int j = 0; j < n_thread; j++)
-		pool.push_back(std::thread(worker, &graph, &result[0], 1));
-
-	for (auto& t : pool)
-		t.join();
-		
-	for (int i = 0; i < r_count; i++)
-		flow += result[i];
-
-	pool.clear();
-	current_region = 0;
-
-	// last call using the whole residual graph 
-   // flow +=graph.maxFlow();
+static void sampleGMMPixels( const Mat& img, const Mat& mask, Rect roi, Mat& samples, Mat& sampleLabels,
+                             Mat& sampleWeights )
+{
+    int outside = img.rows*img.cols - roi.area();
+    int step = std::max(1, cvCeil(std::sqrt((double)outside / roi.area())));
 
-    Point p;
-    for( p.y = 0; p.y < mask.rows; p.y++ )
+    std::vector<Vec3b> colors;
+    std::vector<uchar> labels;
+    for( int y = roi.y; y < roi.y + roi.height; y++ )
     {
-        for( p.x = 0; p.x < mask.cols; p.x++ )
+        for( int x = roi.x; x < roi.x + roi.width; x++ )
         {
-            if( mask.at<uchar>(p) == GC_PR_BGD || mask.at<uchar>(p) == GC_PR_FGD )
-            {
-				int v = ptx2Vtx.at<int>(p);
-				if (v == GC_JNT_BGD )
-				{
-					mask.at<uchar>(p) = GC_PR_BGD;
-				}
-				else if (v == GC_JNT_FGD )
-				{
-					mask.at<uchar>(p) = GC_PR_FGD; 
-				}
-				else if (graph.inSourceSegment(v))
-                    mask.at<uchar>(p) = GC_PR_FGD;
-                else
-                    mask.at<uchar>(p) = GC_PR_BGD;
-            }
+            colors.push_back(img.at<Vec3b>(y, x));
+            labels.push_back(mask.at<uchar>(y, x));
         }
     }
-	return flow;
+    for( int y = 0; y < img.rows; y += step )
+    {
+        for( int x = 0; x < img.cols; x += step )
+        {
+            if( roi.contains(Point(x, y)) )
+                continue;
+            colors.push_back(img.at<Vec3b>(y, x));
+            labels.push_back(mask.at<uchar>(y, x));
+        }
+    }
+    Mat(1, (int)colors.size(), CV_8UC3, &colors[0]).copyTo(samples);
+    Mat(1, (int)labels.size(), CV_8UC1, &labels[0]).copyTo(sampleLabels);
+    sampleWeights.create(1, (int)colors.size(), CV_32SC1);
+    sampleWeights.setTo(Scalar(step*step));
+    sampleWeights(Rect(0, 0, roi.area(), 1)).setTo(Scalar(1));
 }
 
 /*
- Construct non reduced GCGraph. 
- Vertices are indexed by the region number, for parallel computation of max flow.
+  Gather the pixels on which the GMMs of a tile are learned (see GrabCutTiler): the pixels of the
+  tile, in row order, followed by a sample of the whole image, whose pixels have the given weight
+  so that the GMMs stay close to the ones of the whole image, as with sampleGMMPixels. Both GMMs
+  can then be learned even when the tile holds a single class.
+  The labels of the pixels of the tile have to be updated with copyROILabels when the mask changes.
 */
-static void constructGCGraph(const Mat& img, const Mat& mask, const GMM& bgdGMM, const GMM& fgdGMM, double lambda,
-	const Mat& leftW, const Mat& upleftW, const Mat& upW, const Mat& uprightW,
-	GCGraph<double>& graph)
+static void contextGMMPixels( const Mat& img, const Mat& mask, const Mat& context, const Mat& contextLabels,
+                              int contextWeight, Mat& samples, Mat& sampleLabels, Mat& sampleWeights )
 {
-	int vtxCount = img.cols*img.rows,
-		edgeCount = 2 * (4 * img.cols*img.rows - 3 * (img.cols + img.rows) + 2);
-
-	// region numbering
-	int h_size = (img.cols + TRANS) / r_split+1, v_size = (img.rows + TRANS) / r_split+1;
-	
-	std::vector<std::vector<int>> r_index(r_split, std::vector<int>(r_split));
-
-	//quadtree(QT_HEIGHT, r_index);
-	for (int i = 0; i < r_split; i++)
-		for (int j = 0; j < r_split; j++)
-			r_index[i][j] = i*r_split + j;
+    int n = img.rows*img.cols;
+    samples.create(1, n + context.cols, CV_8UC3);
+    sampleLabels.create(1, n + context.cols, CV_8UC1);
+    for( int y = 0; y < img.rows; y++ )
+    {
+        memcpy(samples.ptr<Vec3b>(0) + y*img.cols, img.ptr<Vec3b>(y), img.cols*sizeof(Vec3b));
+        memcpy(sampleLabels.ptr<uchar>(0) + y*img.cols, mask.ptr<uchar>(y), img.cols);
+    }
+    memcpy(samples.ptr<Vec3b>(0) + n, context.ptr<Vec3b>(0), context.cols*sizeof(Vec3b));
+    memcpy(sampleLabels.ptr<uchar>(0) + n, contextLabels.ptr<uchar>(0), context.cols);
+    sampleWeights.create(1, n + context.cols, CV_32SC1);
+    sampleWeights.setTo(Scalar(contextWeight));
+    sampleWeights(Rect(0, 0, n, 1)).setTo(Scalar(1));
+}
 
-	graph.create(vtxCount, edgeCount);
-	Point p;
-	//int count = 0;
-	for (p.y = 0; p.y < img.rows; p.y++)
-	{
-		for (p.x = 0; p.x < img.cols; p.x++)
-		{
-			// add node
-			int r = r_index[p.y / v_size][p.x / h_size];
-			int r1 = r_index[p.y / v_size][(p.x + TRANS) / h_size];
-			int r2 = r_index[(p.y + TRANS) / v_size][p.x / h_size];
-			int r3 = r_index[(p.y + TRANS) / v_size][(p.x + TRANS) / h_size];
+/*
+  Update the labels of the pixels of roi in the samples of sampleGMMPixels
+*/
+static void copyROILabels( const Mat& roiMask, Mat& sampleLabels )
+{
+    uchar* dst = sampleLabels.ptr<uchar>(0);
+    for( int y = 0; y < roiMask.rows; y++, dst += roiMask.cols )
+        memcpy(dst, roiMask.ptr<uchar>(y), roiMask.cols);
+}
 
-			int alt_r = r;
+/*
+ multithread stuff 
+*/
 
-			if (r != r1)
-				if (r == r2)
-					alt_r = r1;
-				else
-					alt_r = r3;
-			else
-				if (r != r2)
-					alt_r = r2;
 
-			int vtxIdx = graph.addVtx(r, alt_r);
+#define r_split 8
 
-			Vec3b color = img.at<Vec3b>(p);
+// regions in image
+#define r_count r_split*r_split
 
-			// set t-weights
-			double fromSource, toSink;
-			if (mask.at<uchar>(p) == GC_PR_BGD || mask.at<uchar>(p) == GC_PR_FGD)
-			{
-				fromSource = -log(bgdGMM(color));
-				toSink = -log(fgdGMM(color));
-			}
-			else if (mask.at<uchar>(p) == GC_BGD)
-			{
-				fromSource = 0;
-				toSink = lambda;
-			}
-			else // GC_FGD
-			{
-				fromSource = lambda;
-				toSink = 0;
-			}
-			graph.addTermWeights(vtxIdx, fromSource, toSink);
+/*
+ NUMA nodes of the machine, with the CPUs of each one (Linux). Empty when the machine has a
+ single node.
+*/
+struct NumaNode
+{
+	int id;
+	std::vector<int> cpus;
+};
 
-			// set n-weights
-			if (p.x>0)
-			{
-				double w = leftW.at<double>(p);
-				graph.addEdges(vtxIdx, vtxIdx - 1, w, w);
-			}
-			if (p.x>0 && p.y>0)
-			{
-				double w = upleftW.at<double>(p);
-				graph.addEdges(vtxIdx, vtxIdx - img.cols - 1, w, w);
-			}
-			if (p.y>0)
-			{
-				double w = upW.at<double>(p);
-				graph.addEdges(vtxIdx, vtxIdx - img.cols, w, w);
-			}
-			if (p.x<img.cols - 1 && p.y>0)
+static std::vector<NumaNode> numaNodes()
+{
+	std::vector<NumaNode> nodes;
+#if defined __linux__
+	for (int id = 0; id < 1024; id++)
+	{
+		char path[64];
+		sprintf(path, "/sys/devices/system/node/node%d/cpulist", id);
+		FILE* f = fopen(path, "r");
+		if (!f)
+			continue;
+		// list of ranges, e.g. 0-7,16-23
+		NumaNode node;
+		node.id = id;
+		int first, last;
+		while (fscanf(f, "%d", &first) == 1)
+		{
+			last = first;
+			int c = fgetc(f);
+			if (c == '-')
 			{
-				double w = uprightW.at<double>(p);
-				graph.addEdges(vtxIdx, vtxIdx - img.cols + 1, w, w);
+				if (fscanf(f, "%d", &last) != 1)
+					break;
+				c = fgetc(f);
 			}
+			for (int cpu = first; cpu <= last; cpu++)
+				node.cpus.push_back(cpu);
+			if (c != ',')
+				break;
 		}
+		fclose(f);
+		if (!node.cpus.empty())
+			nodes.push_back(node);
 	}
+#endif
+	if (nodes.size() < 2)
+		nodes.clear();
+	return nodes;
 }
 
 /*
- Multithreaded estimateSegmentation with non reduced graph
+ Persistent pool of worker threads shared by all the grabCut calls of the process, so that the
+ parallel phases of an iteration do not create threads, and concurrent or nested calls do not
+ run more threads than cores.
+ run(n, body) executes body(i) for i in [0, n) on the workers and on the calling thread, and
+ returns when all the calls are done. The calling thread keeps executing the tasks of its own
+ job until none is left, so a nested run called from a task always progresses, the idle
+ workers only helping: a batch of images running on all the workers then solves its per-image
+ phases sequentially, while a single image gets all the workers.
+ On a NUMA machine, the workers are spread over the nodes, each one pinned to the CPUs of its
+ node, so that a task can work on memory local to its thread (see regionsMaxFlow).
 */
-static double estimateSegmentation(GCGraph<double>& graph, Mat& mask)
+class GrabCutThreadPool
 {
-	double flow = 0;
-	current_region = 0;
-	
-	double result[r_count];
-	std::vector<std::thread> pool;
+public:
+	static GrabCutThreadPool& instance()
+	{
+		static GrabCutThreadPool pool;
+		return pool;
+	}
+	int threadCount() const { return (int)workers.size() + 1; }
+	void run(int n, const std::function<void(int)>& body);
 
-	int n_thread = std::thread::hardware_concurrency();
+	// NUMA nodes the workers are pinned to, none on a machine with a single node
+	int nodeCount() const { return (int)nodes.size(); }
+	std::vector<int> nodeIds() const;
+	// index in [0, nodeCount()) of the node of the calling thread, -1 when it is not a worker
+	static int currentNode() { return threadNode(); }
 
-	// launch parallel computations of partial max flows
-	for (int lv = 0; lv < 1; lv++)
+private:
+	struct Job
 	{
-		for (int j = 0; j < n_thread; j++)
-			pool.push_back(std::thread(worker, &graph, &result[0], 0));
-
-		for (auto& t : pool)
-			t.join();
+		const std::function<void(int)>* body;
+		int n, next, done;
+		std::exception_ptr error;
+	};
+
+	GrabCutThreadPool();
+	~GrabCutThreadPool();
+	void workerLoop(int node);
+	bool execute(Job& job, std::unique_lock<std::mutex>& lk);
+	static int& threadNode()
+	{
+		static thread_local int node = -1;
+		return node;
+	}
 
-		for (int i = 0; (i << lv)< r_count; i++)
-			flow += result[i << lv];
+	std::vector<NumaNode> nodes;
+	std::vector<std::thread> workers;
+	std::deque<Job*> jobs;
+	std::mutex mtx;
+	std::condition_variable jobCv, doneCv;
+	bool stop;
+};
 
-		pool.clear();
-		current_region = 0;
-	}
+GrabCutThreadPool::GrabCutThreadPool() : nodes(numaNodes()), stop(false)
+{
+	int n = std::max((int)std::thread::hardware_concurrency(), 1);
+	// the workers are split in consecutive blocks, one per node
+	for (int i = 1; i < n; i++)
+		workers.push_back(std::thread(&GrabCutThreadPool::workerLoop, this, nodes.empty() ? -1 : i * (int)nodes.size() / n));
+}
 
-	// last call on the whole residual graph
-	flow +=graph.maxFlow();
+std::vector<int> GrabCutThreadPool::nodeIds() const
+{
+	std::vector<int> ids;
+	for (size_t i = 0; i < nodes.size(); i++)
+		ids.push_back(nodes[i].id);
+	return ids;
+}
 
-	Point p;
-	for (p.y = 0; p.y < mask.rows; p.y++)
+GrabCutThreadPool::~GrabCutThreadPool()
+{
 	{
-		for (p.x = 0; p.x < mask.cols; p.x++)
-		{
-			if (mask.at<uchar>(p) == GC_PR_BGD || mask.at<uchar>(p) == GC_PR_FGD)
-			{
-				if (graph.inSourceSegment(p.y*mask.cols + p.x /*vertex index*/))
-					mask.at<uchar>(p) = GC_PR_FGD;
-				else
-					mask.at<uchar>(p) = GC_PR_BGD;
-			}
-		}
+		std::lock_guard<std::mutex> lk(mtx);
+		stop = true;
 	}
-	return flow;
+	jobCv.notify_all();
+	for (auto& t : workers)
+		t.join();
 }
+
 /*
- Multithreaded version of grabCut
- Non reduced graph
+ Execute one task of job, returns false when all its tasks are taken. lk holds the lock of the
+ pool on entry and on exit.
 */
-void cv::grabCut(InputArray _img, InputOutputArray _mask, Rect rect,
-	InputOutputArray _bgdModel, InputOutputArray _fgdModel,
-	int iterCount, int mode)
+bool GrabCutThreadPool::execute(Job& job, std::unique_lock<std::mutex>& lk)
 {
-	Mat img = _img.getMat();
-	Mat& mask = _mask.getMatRef();
-	Mat& bgdModel = _bgdModel.getMatRef();
-	Mat& fgdModel = _fgdModel.getMatRef();
-	clock_t tStart, tEnd;
-
-	if (img.empty())
-		CV_Error(CV_StsBadArg, "image is empty");
-	if (img.type() != CV_8UC3)
-		CV_Error(CV_StsBadArg, "image must have CV_8UC3 type");
-
-	GMM bgdGMM(bgdModel), fgdGMM(fgdModel);
-	Mat compIdxs(img.size(), CV_32SC1);
+	if (job.next >= job.n)
+		return false;
+	int i = job.next++;
+	if (job.next == job.n)
+	{
+		std::deque<Job*>::iterator it = std::find(jobs.begin(), jobs.end(), &job);
+		if (it != jobs.end())
+			jobs.erase(it);
+	}
+	lk.unlock();
 
-	if (mode == GC_INIT_WITH_RECT || mode == GC_INIT_WITH_MASK)
+	std::exception_ptr error;
+	try
 	{
-		if (mode == GC_INIT_WITH_RECT)
-			initMaskWithRect(mask, img.size(), rect);
-		else // flag == GC_INIT_WITH_MASK
-			checkMask(img, mask);
-		initGMMs(img, mask, bgdGMM, fgdGMM);
+		(*job.body)(i);
+	}
+	catch (...)
+	{
+		error = std::current_exception();
 	}
 
-	if (iterCount <= 0)
+	// the job lives in the stack of run, and is released once its last task is done
+	lk.lock();
+	if (error && !job.error)
+		job.error = error;
+	if (++job.done == job.n)
+		doneCv.notify_all();
+	return true;
+}
+
+void GrabCutThreadPool::workerLoop(int node)
+{
+#if defined __linux__
+	if (node >= 0)
+	{
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		for (size_t i = 0; i < nodes[node].cpus.size(); i++)
+			if (nodes[node].cpus[i] < CPU_SETSIZE)
+				CPU_SET(nodes[node].cpus[i], &cpus);
+		if (sched_setaffinity(0, sizeof(cpus), &cpus) == 0)
+			threadNode() = node;
+	}
+#endif
+
+	std::unique_lock<std::mutex> lk(mtx);
+	for (;;)
+	{
+		jobCv.wait(lk, [this] { return stop || !jobs.empty(); });
+		if (stop)
+			return;
+		execute(*jobs.front(), lk);
+	}
+}
+
+void GrabCutThreadPool::run(int n, const std::function<void(int)>& body)
+{
+	if (n <= 1 || workers.empty())
+	{
+		for (int i = 0; i < n; i++)
+			body(i);
+		return;
+	}
+
+	Job job;
+	job.body = &body;
+	job.n = n;
+	job.next = job.done = 0;
+	std::unique_lock<std::mutex> lk(mtx);
+	jobs.push_back(&job);
+	jobCv.notify_all();
+
+	while (execute(job, lk))
+		;
+
+	doneCv.wait(lk, [&job] { return job.done == job.n; });
+	if (job.error)
+		std::rethrow_exception(job.error);
+}
+
+/*
+ Node of a region, on a NUMA machine with the given number of nodes: the regions are split in
+ bands of rows, the first band going to the first node. It matches the placement of the graph
+ arrays by the arena (see GCGraphArena::setNodes), which follow the rows of the image.
+*/
+static inline int regionNode(int region, int f, int nodeCount)
+{
+	int rows = f ? r_split - 1 : r_split;
+	return std::min(region / r_split * nodeCount / rows, nodeCount - 1);
+}
+
+/*
+ Run maxFlow(region, f), with the pages of a region of flag 0 read ahead and dropped afterwards
+ when the graph is in files (see GCGraphArena::setStorage).
+*/
+template <class TIndex, class TCap>
+static double regionMaxFlow(GCGraph<double, TIndex, TCap>& graph, int region, int f)
+{
+	if (f == 0)
+		graph.adviseRegion(region, true);
+	double flow = graph.maxFlow(region, f);
+	if (f == 0)
+		graph.adviseRegion(region, false);
+	return flow;
+}
+
+/*
+ Run maxFlow(region, f) on every region of the graph in parallel, and return the sum of the flows.
+ On a NUMA machine, a task takes a region of the node of its thread while there are some left.
+*/
+template <class TIndex, class TCap>
+static double regionsMaxFlow(GCGraph<double, TIndex, TCap>& graph, int f)
+{
+	graph.finalize();
+	double result[r_count];
+	GrabCutThreadPool& pool = GrabCutThreadPool::instance();
+	const int nodeCount = pool.nodeCount();
+	if (nodeCount == 0)
+	{
+		pool.run(r_count, [&](int region)
+		{
+			result[region] = regionMaxFlow(graph, region, f);
+		});
+	}
+	else
+	{
+		std::vector<std::vector<int> > pending(nodeCount);
+		for (int region = r_count - 1; region >= 0; region--)
+			pending[regionNode(region, f, nodeCount)].push_back(region);
+		std::mutex mtx;
+		pool.run(r_count, [&](int)
+		{
+			int region;
+			{
+				std::lock_guard<std::mutex> lk(mtx);
+				int node = GrabCutThreadPool::currentNode();
+				if (node < 0 || pending[node].empty())
+					for (node = 0; pending[node].empty(); node++)
+						;
+				region = pending[node].back();
+				pending[node].pop_back();
+			}
+			result[region] = regionMaxFlow(graph, region, f);
+		});
+	}
+
+	double flow = 0;
+	for (int i = 0; i < r_count; i++)
+		flow += result[i];
+	return flow;
+}
+
+/*
+ Run body(y0, y1) on horizontal bands [y0, y1) of an image with the given number of rows,
+ one band per thread of the pool.
+*/
+static void parallelRows(int rows, const std::function<void(int, int)>& body)
+{
+	int n = std::max(1, std::min(GrabCutThreadPool::instance().threadCount(), rows));
+	GrabCutThreadPool::instance().run(n, [&](int j)
+	{
+		body(rows*j / n, rows*(j + 1) / n);
+	});
+}
+
+/*
+ Local bounds of a pixel p which is not joined to a terminal:
+ e is the net t-link capacity (source - sink), including the n-links to the neighbors joined
+ to a terminal, and s the sum of the capacities of the n-links to the other neighbors, for the
+ connectivity Conn.
+*/
+template <int Conn>
+static inline void localBounds(const Mat& pxl2Vtx, const Mat& tWeights, const Mat* nW[4], Point p, double& e, double& s)
+{
+	const Vec2d& tw = tWeights.at<Vec2d>(p);
+	const bool inner = p.x > 0 && p.x < pxl2Vtx.cols - 1 && p.y > 0 && p.y < pxl2Vtx.rows - 1;
+	e = tw[0] - tw[1];
+	s = 0;
+	for (int k = 0; k < 8; k += 8 / Conn)
+	{
+		Point q(p.x + nbr_dx[k], p.y + nbr_dy[k]);
+		if (!inner && (q.x < 0 || q.x >= pxl2Vtx.cols || q.y < 0 || q.y >= pxl2Vtx.rows))
+			continue;
+		double w = (k < 4) ? nW[k]->at<double>(p) : nW[k - 4]->at<double>(q);
+		int n = pxl2Vtx.at<int>(q);
+		if (n >= 0)
+			s += w;
+		else
+			e += jfg(n) ? w : -w;
+	}
+}
+
+/*
+ Persistency-based partial labeling.
+ Whatever the labels of its neighbors, a pixel p is labeled FG by every min cut when
+ e >= s, and BG when -e >= s (see localBounds): the labeling is then persistent and p can be
+ joined to the corresponding terminal. This is the local bound of Kovtun's partial optimality,
+ which for the Potts n-links of GrabCut coincides with the SlimCuts rule of Scheuermann and Rosenhahn.
+ Kovtun's stronger, non-local criterion is not used: it needs the min cuts of auxiliary problems
+ as large as the graph itself, while the graph solved afterwards already gives the exact labels.
+ The test only reads the labels of the previous round, so each round runs in parallel on bands of rows.
+ Rounds are repeated while they fix a significant number of pixels.
+ On output prev holds the labels before the last round, and joinRank, when given, the round
+ (from 1) at which each pixel is fixed.
+ Returns the number of pixels fixed.
+*/
+template <int Conn>
+static int persistencyLabeling(const Mat& tWeights, const Mat* nW[4], Mat& pxl2Vtx, Mat& prev, Mat* joinRank)
+{
+	std::mutex mtx;
+	int fixedCount = 0, undecided = 0, round = 0;
+
+	for (int i = 0; i < pxl2Vtx.rows; i++)
+		for (int j = 0; j < pxl2Vtx.cols; j++)
+			undecided += pxl2Vtx.at<int>(i, j) >= 0;
+
+	for (;;)
+	{
+		int roundCount = 0;
+		round++;
+		pxl2Vtx.copyTo(prev);
+		parallelRows(pxl2Vtx.rows, [&](int y0, int y1)
+		{
+			int count = 0;
+			Point p;
+			for (p.y = y0; p.y < y1; p.y++)
+			{
+				for (p.x = 0; p.x < pxl2Vtx.cols; p.x++)
+				{
+					if (prev.at<int>(p) < 0)
+						continue;
+					double e, s;
+					localBounds<Conn>(prev, tWeights, nW, p, e, s);
+					if (e >= s)
+						pxl2Vtx.at<int>(p) = GC_JNT_FGD;
+					else if (-e >= s)
+						pxl2Vtx.at<int>(p) = GC_JNT_BGD;
+					else
+						continue;
+					if (joinRank)
+						joinRank->at<int>(p) = round;
+					count++;
+				}
+			}
+			std::lock_guard<std::mutex> lk(mtx);
+			roundCount += count;
+		});
+		fixedCount += roundCount;
+		undecided -= roundCount;
+
+		// the last rounds fix few pixels, mostly along chains: leave them to the sequential propagation
+		if (roundCount <= (undecided >> 6))
+			break;
+	}
+	return fixedCount;
+}
+
+/*
+ SlimCuts reduction (Scheuermann and Rosenhahn).
+ A vertex lies in the source (resp. sink) segment of a min cut when the capacity of its
+ t-link to the source (resp. sink) is not lower than the sum of the capacities of its n-links,
+ so it can be joined to this terminal.
+ Pixels marked as BG or FG are joined first, then the rule is applied to the pixels marked
+ as GC_PR_BGD or GC_PR_FGD until no more vertex can be joined: joining a pixel turns the
+ n-links to its neighbors into t-links, which may make these neighbors dominated in turn.
+ The bulk of the pixels is fixed by the parallel rounds of persistencyLabeling, the propagation
+ is then completed sequentially from the pixels fixed by the last round.
+ On output pxl2Vtx is GC_JNT_BGD or GC_JNT_FGD for the joined pixels and 0 for the others,
+ and tWeights holds the t-weights (fromSource, toSink) computed from the GMMs, or from
+ lambda for the pixels marked as BG or FG.
+ The t-links cut by the joins are added to sourceToSinkW, so that the flow of the reduced
+ graph plus sourceToSinkW is still the flow of the non reduced graph.
+ When joinRank is given, it records the order of the joins: 0 for the pixels marked as BG or FG,
+ -1 for the pixels which are not joined, and otherwise a rank greater than the ranks of the
+ neighbors whose join the test of the pixel relied on.
+ The neighbors are those of the connectivity Conn.
+ Returns the number of GC_PR_BGD or GC_PR_FGD pixels joined to a terminal.
+*/
+template <int Conn, int K>
+static int reduceGCGraph_slim( const Mat& img, const Mat& mask, const GMM<K>& bgdGMM, const GMM<K>& fgdGMM, double lambda,
+	const Mat& leftW, const Mat& upleftW, const Mat& upW, const Mat& uprightW,
+	Mat& pxl2Vtx, Mat& tWeights, double& sourceToSinkW, Mat* joinRank = 0 )
+{
+	const Mat* nW[4] = { &leftW, &upleftW, &upW, &uprightW };
+	std::mutex mtx;
+
+	tWeights.create(img.size(), CV_64FC2);
+	if (joinRank)
+		joinRank->create(img.size(), CV_32SC1);
+	parallelRows(img.rows, [&](int y0, int y1)
+	{
+		Point p;
+		for (p.y = y0; p.y < y1; p.y++)
+		{
+			for (p.x = 0; p.x < img.cols; p.x++)
+			{
+				uchar m = mask.at<uchar>(p);
+				if (m == GC_PR_BGD || m == GC_PR_FGD)
+				{
+					Vec3b color = img.at<Vec3b>(p);
+					Vec2d& tw = tWeights.at<Vec2d>(p);
+					tw[0] = -log(bgdGMM(color));
+					tw[1] = -log(fgdGMM(color));
+					pxl2Vtx.at<int>(p) = 0;
+				}
+				else
+				{
+					tWeights.at<Vec2d>(p) = (m == GC_BGD) ? Vec2d(0, lambda) : Vec2d(lambda, 0);
+					pxl2Vtx.at<int>(p) = (m == GC_BGD) ? GC_JNT_BGD : GC_JNT_FGD;
+				}
+				if (joinRank)
+					joinRank->at<int>(p) = pxl2Vtx.at<int>(p) < 0 ? 0 : -1;
+			}
+		}
+	});
+
+	Mat prev;
+	persistencyLabeling<Conn>(tWeights, nW, pxl2Vtx, prev, joinRank);
+
+	// sequential propagation, from the neighbors of the pixels fixed by the last round
+	std::vector<Point> queue;
+	Point p;
+	int rank = 0;
+	for (p.y = 0; p.y < img.rows; p.y++)
+		for (p.x = 0; p.x < img.cols; p.x++)
+			if (pxl2Vtx.at<int>(p) < 0 && prev.at<int>(p) >= 0)
+			{
+				queue.push_back(p);
+				if (joinRank)
+					rank = joinRank->at<int>(p);
+			}
+
+	while (!queue.empty())
+	{
+		p = queue.back();
+		queue.pop_back();
+		int& vtx = pxl2Vtx.at<int>(p);
+		if (vtx >= 0)
+		{
+			double e, s;
+			localBounds<Conn>(pxl2Vtx, tWeights, nW, p, e, s);
+			if (e >= s)
+				vtx = GC_JNT_FGD;
+			else if (-e >= s)
+				vtx = GC_JNT_BGD;
+			else
+				continue;
+			if (joinRank)
+				joinRank->at<int>(p) = ++rank;
+		}
+		for (int k = 0; k < 8; k += 8 / Conn)
+		{
+			Point q(p.x + nbr_dx[k], p.y + nbr_dy[k]);
+			if (q.x >= 0 && q.x < img.cols && q.y >= 0 && q.y < img.rows && pxl2Vtx.at<int>(q) >= 0)
+				queue.push_back(q);
+		}
+	}
+
+	// cost of the t-links cut by the joins
+	int joined = 0;
+	parallelRows(img.rows, [&](int y0, int y1)
+	{
+		int count = 0;
+		double w = 0;
+		Point p;
+		for (p.y = y0; p.y < y1; p.y++)
+		{
+			for (p.x = 0; p.x < img.cols; p.x++)
+			{
+				uchar m = mask.at<uchar>(p);
+				int vtx = pxl2Vtx.at<int>(p);
+				if ((m != GC_PR_BGD && m != GC_PR_FGD) || vtx >= 0)
+					continue;
+				const Vec2d& tw = tWeights.at<Vec2d>(p);
+				w += jfg(vtx) ? tw[1] : tw[0];
+				count++;
+			}
+		}
+		std::lock_guard<std::mutex> lk(mtx);
+		sourceToSinkW += w;
+		joined += count;
+	});
+	return joined;
+}
+
+/*
+ The Mat pxl2Edge holds for each pixel the indices of 4 edges of type TIndex: CV_32SC4 for
+ int indices, CV_32SC(8) for int64 ones.
+*/
+template <class TIndex>
+static inline int pixelEdgesType()
+{
+	return CV_32SC(4 * (int)(sizeof(TIndex) / sizeof(int)));
+}
+
+template <class TIndex>
+static inline TIndex* pixelEdges( Mat& pxl2Edge, Point p )
+{
+	return (TIndex*)pxl2Edge.ptr(p.y) + 4 * p.x;
+}
+
+template <class TIndex>
+static inline const TIndex* pixelEdges( const Mat& pxl2Edge, Point p )
+{
+	return (const TIndex*)pxl2Edge.ptr(p.y) + 4 * p.x;
+}
+
+/*
+ Whether the graph of an image of size sz has more edges than GCGraph<double, int> can index,
+ so that it has to be built as a GCGraph<double, int64>. There are about 8 directed edges per pixel
+ with the 8-connectivity and 4 with the 4-connectivity, so the switch happens at about 268 MP and
+ 537 MP respectively. The vertices stay indexed by the int Mat pxl2Vtx, so the
+ number of pixels is limited to INT_MAX.
+*/
+static bool needsWideGCGraph( Size sz, int connectivity )
+{
+	int64 vtxCount = (int64)sz.width * sz.height,
+		edgeCount = 2 * nbrPairCount(sz, connectivity);
+	if (vtxCount > INT_MAX)
+		CV_Error(CV_StsOutOfRange, "The image has too many pixels for grabCut");
+	return edgeCount + 2 > INT_MAX;
+}
+
+/*
+ Build the partially reduced GCGraph for the pixels merged with terminal nodes given by
+ pxl2Vtx (see reduceGCGraph_slim), and the t-weights tWeights computed from the GMMs.
+ On output the Mat pxl2Vtx records the index of vertex for each pixel, or the terminal
+ it is merged with, and the Mat pxl2Edge the indices of the edges to its left, upleft,
+ up and upright neighbors (0 if there is no such edge). Only the neighbors of the connectivity
+ Conn are linked, the 4-connectivity halving the number of edges. The graph is sized from the
+ pixels left as vertices, e.g. the narrow band only.
+ To enable parallel computation of max Flow, the image is partitionned into
+ regions, and each vertex is indexed by the corresponding region number.
+*/
+template <int Conn, class TIndex, class TCap>
+static void buildGCGraph_slim( const Mat& img, const Mat& leftW, const Mat& upleftW, const Mat& upW, const Mat& uprightW,
+					   GCGraph<double, TIndex, TCap>& graph, Mat& pxl2Vtx, Mat& pxl2Edge, const Mat& tWeights)
+{
+	const Mat* nW[4] = { &leftW, &upleftW, &upW, &uprightW };
+	int64 vtxCount = 0, edgeCount = 0;
+	std::mutex mtx;
+	parallelRows(img.rows, [&](int y0, int y1)
+	{
+		int64 rowsVtxCount = 0, rowsEdgeCount = 0;
+		for (int y = y0; y < y1; y++)
+		{
+			for (int x = 0; x < img.cols; x++)
+			{
+				if (pxl2Vtx.at<int>(y, x) < 0)
+					continue;
+				rowsVtxCount++;
+				for (int k = 0; k < 4; k += 8 / Conn)
+				{
+					int qx = x + nbr_dx[k], qy = y + nbr_dy[k];
+					if (qx >= 0 && qx < img.cols && qy >= 0 && pxl2Vtx.at<int>(qy, qx) >= 0)
+						rowsEdgeCount += 2;
+				}
+			}
+		}
+		std::lock_guard<std::mutex> lk(mtx);
+		vtxCount += rowsVtxCount;
+		edgeCount += rowsEdgeCount;
+	});
+	if (edgeCount + 2 > (int64)std::numeric_limits<TIndex>::max())
+		CV_Error(CV_StsOutOfRange, "Too many edges for the index type of the graph (see needsWideGCGraph)");
+
+	// region numbering
+#define TRANS 200
+	//int h_size = (img.cols+TRANS) / r_split + 1, v_size = (img.rows + TRANS)/ r_split + 1;
+	int h_size = img.cols / r_split + 1, v_size = img.rows  / r_split + 1;
+
+	int r_split2 = r_split - 1;
+	int h_size2 = img.cols / r_split2 + 1, v_size2 = img.rows / r_split2 + 1;
+
+	std::vector<std::vector<int>> r_index(r_split, std::vector<int>(r_split));
+	std::vector<std::vector<int>> r_index2(r_split, std::vector<int>(r_split));
+
+	//quadtree(QT_HEIGHT, r_index);
+	for (int i = 0; i < r_split; i++)
+		for (int j = 0; j < r_split; j++)
+			r_index[i][j] = i*r_split + j;
+	
+	for (int i = 0; i < r_split2; i++)
+		for (int j = 0; j < r_split2; j++)
+			r_index2[i][j] = i*r_split2 + j;
+    graph.create((size_t)vtxCount, (size_t)edgeCount);
+	pxl2Edge.create(img.size(), pixelEdgesType<TIndex>());
+	pxl2Edge.reshape(4).setTo(Scalar::all(0)); // a Scalar cannot set the 8 channels of int64 indices
+    Point p;
+	//int vtxIdx;
+
+	// the vertices, then the edges, are added tile by tile (the regions of flag 0, see vtxRegions_slim),
+	// so that the working set of a region is contiguous
+	TIndex regionVtcs[r_count + 1];
+	for (int t = 0; t < r_count; t++)
+	{
+		Rect tile = Rect((t % r_split)*h_size, (t / r_split)*v_size, h_size, v_size) & Rect(0, 0, img.cols, img.rows);
+		regionVtcs[t] = graph.vtxCount();
+		for (p.y = tile.y; p.y < tile.y + tile.height; p.y++)
+		{
+			for (p.x = tile.x; p.x < tile.x + tile.width; p.x++)
+			{
+				// add node and set its t-weights
+				double fromSource, toSink;
+				if( pxl2Vtx.at<int>(p) >= 0 )
+				{
+					int r = r_index[p.y / v_size][p.x / h_size];
+					int alt_r = r_index[p.y / v_size2][p.x / h_size2];
+					int vtxIdx = (int)graph.addVtx(r, alt_r);
+					pxl2Vtx.at<int>(p) = vtxIdx;
+					fromSource = tWeights.at<Vec2d>(p)[0];
+					toSink = tWeights.at<Vec2d>(p)[1];
+					graph.addTermWeights(vtxIdx, fromSource, toSink);
+				}
+				// else pixel joined to the sink (GC_JNT_BGD) or to the source (GC_JNT_FGD).
+				// For BG or FG pixels, fromSource = 0 (resp. toSink = 0), so the weight of edge(source, sink)
+				// is unmodified and the edge toSink = lambda (resp. fromSource = lambda) is deleted by the join operation
+			}
+		}
+	}
+	regionVtcs[r_count] = graph.vtxCount();
+
+	for (int t = 0; t < r_count; t++)
+	{
+		Rect tile = Rect((t % r_split)*h_size, (t / r_split)*v_size, h_size, v_size) & Rect(0, 0, img.cols, img.rows);
+		TIndex edge0 = graph.edgeCount();
+		for (p.y = tile.y; p.y < tile.y + tile.height; p.y++)
+		{
+			for (p.x = tile.x; p.x < tile.x + tile.width; p.x++)
+			{
+				// Set n-weights and t-weights for non terminal neighbors
+				// Update t-weights for terminal neighbors.
+				int vtx = pxl2Vtx.at<int>(p); 
+				const bool inner = p.x > 0 && p.x < img.cols - 1 && p.y > 0;
+				for (int k = 0; k < 4; k += 8 / Conn)
+				{
+					Point q(p.x + nbr_dx[k], p.y + nbr_dy[k]);
+					if (!inner && (q.x < 0 || q.x >= img.cols || q.y < 0))
+						continue;
+					double w = nW[k]->at<double>(p);
+					int n = pxl2Vtx.at<int>(q);
+					if (n >= 0)  // no terminal neighbor
+						if (vtx >= 0) // no terminal node
+							pixelEdges<TIndex>(pxl2Edge, p)[k] = graph.addEdges(vtx, n, w, w);
+						else
+							graph.addTermWeights(n, (jfg(vtx) ? w : 0), (jbg(vtx) ? w : 0));
+					else // neighbor is terminal
+						if (vtx >= 0)
+							graph.addTermWeights(vtx, (jfg(n) ? w : 0), (jbg(n) ? w : 0));
+						else
+							if (jbg(vtx) != jbg(n))
+								graph.sourceToSinkW += w;
+				}
+			}
+		}
+		graph.setRegionSpan(t, regionVtcs[t], regionVtcs[t + 1], edge0, graph.edgeCount());
+	}
+}
+
+/*
+ Construct partially reduced GCGraph. 
+ Pixels marked as BG or FG, and pixels with dominant t-links (see reduceGCGraph_slim),
+ are merged with terminal nodes, see buildGCGraph_slim for pxl2Vtx and pxl2Edge.
+ The Mat tWeights records the t-weights computed from the GMMs, joinRank the order of the joins.
+ The n-links are those of the connectivity Conn, the n-weights being computed by calcNWeights<Conn>.
+ Returns the number of GC_PR_BGD or GC_PR_FGD pixels merged with a terminal node.
+*/
+template <int Conn, class TIndex, class TCap, int K>
+static int constructGCGraph_slim( const Mat& img, const Mat& mask, const GMM<K>& bgdGMM, const GMM<K>& fgdGMM, double lambda,
+                       const Mat& leftW, const Mat& upleftW, const Mat& upW, const Mat& uprightW,
+					   GCGraph<double, TIndex, TCap>& graph, Mat& pxl2Vtx, Mat& pxl2Edge, Mat& tWeights, Mat* joinRank = 0)
+{
+	int joined = reduceGCGraph_slim<Conn>(img, mask, bgdGMM, fgdGMM, lambda, leftW, upleftW, upW, uprightW, pxl2Vtx, tWeights, graph.sourceToSinkW, joinRank);
+	buildGCGraph_slim<Conn>(img, leftW, upleftW, upW, uprightW, graph, pxl2Vtx, pxl2Edge, tWeights);
+	return joined;
+}
+
+/*
+ Regions of the vertex of pixel p, numbered as in constructGCGraph_slim
+*/
+static inline void vtxRegions_slim(Point p, Size sz, int& r, int& alt_r)
+{
+	int h_size = sz.width / r_split + 1, v_size = sz.height / r_split + 1;
+	int h_size2 = sz.width / (r_split - 1) + 1, v_size2 = sz.height / (r_split - 1) + 1;
+	r = (p.y / v_size) * r_split + p.x / h_size;
+	alt_r = (p.y / v_size2) * r_split + p.x / h_size2;
+}
+
+/*
+ Rewrite all the capacities of a graph built by constructGCGraph_slim, keeping its vertices
+ and edges, and cancel its flow. The pixels merged with terminal nodes are given by pxl2Vtx,
+ which may differ from the ones of the construction as long as the pixels which are vertices
+ remain vertices. Each band of rows is rewritten by its own thread.
+ Returns the number of GC_PR_BGD or GC_PR_FGD pixels merged with a terminal node.
+*/
+template <int Conn, class TIndex, class TCap>
+static int setGCGraphWeights_slim( const Mat& mask, const Mat& leftW, const Mat& upleftW, const Mat& upW, const Mat& uprightW,
+	const Mat& pxl2Vtx, const Mat& pxl2Edge, const Mat& tWeights, GCGraph<double, TIndex, TCap>& graph )
+{
+	const Mat* nW[4] = { &leftW, &upleftW, &upW, &uprightW };
+	std::mutex mtx;
+	int joined = 0;
+
+	graph.resetFlow();
+	graph.sourceToSinkW = 0;
+	parallelRows(mask.rows, [&](int y0, int y1)
+	{
+		double sourceToSinkW = 0;
+		int count = 0;
+		Point p;
+		for (p.y = y0; p.y < y1; p.y++)
+		{
+			for (p.x = 0; p.x < mask.cols; p.x++)
+			{
+				int vtx = pxl2Vtx.at<int>(p);
+				if (vtx >= 0)
+				{
+					// t-weights, including the n-links to the neighbors merged with a terminal
+					double fromSource = tWeights.at<Vec2d>(p)[0], toSink = tWeights.at<Vec2d>(p)[1];
+					for (int k = 0; k < 8; k += 8 / Conn)
+					{
+						Point q(p.x + nbr_dx[k], p.y + nbr_dy[k]);
+						if (q.x < 0 || q.x >= mask.cols || q.y < 0 || q.y >= mask.rows)
+							continue;
+						int n = pxl2Vtx.at<int>(q);
+						if (n >= 0)
+							continue;
+						double w = (k < 4) ? nW[k]->at<double>(p) : nW[k - 4]->at<double>(q);
+						if (jfg(n))
+							fromSource += w;
+						else
+							toSink += w;
+					}
+					graph.setTermWeights(vtx, fromSource, toSink);
+					sourceToSinkW += std::min(fromSource, toSink);
+				}
+				else if (mask.at<uchar>(p) == GC_PR_BGD || mask.at<uchar>(p) == GC_PR_FGD)
+				{
+					sourceToSinkW += jfg(vtx) ? tWeights.at<Vec2d>(p)[1] : tWeights.at<Vec2d>(p)[0];
+					count++;
+				}
+
+				// n-weights, each edge being set by the pixel holding its weight
+				const TIndex* pe = pixelEdges<TIndex>(pxl2Edge, p);
+				for (int k = 0; k < 4; k += 8 / Conn)
+				{
+					Point q(p.x + nbr_dx[k], p.y + nbr_dy[k]);
+					if (q.x < 0 || q.x >= mask.cols || q.y < 0)
+						continue;
+					double w = nW[k]->at<double>(p);
+					int n = pxl2Vtx.at<int>(q);
+					if (vtx >= 0 && n >= 0)
+						graph.setEdgeWeights(pe[k], w, w);
+					else if (vtx < 0 && n < 0 && jbg(vtx) != jbg(n))
+						sourceToSinkW += w;
+				}
+			}
+		}
+		std::lock_guard<std::mutex> lk(mtx);
+		graph.sourceToSinkW += sourceToSinkW;
+		joined += count;
+	});
+	return joined;
+}
+
+/*
+ Release a pixel p merged with a terminal node into a graph built by constructGCGraph_slim:
+ p is added to the graph as a new vertex with the t-weights tw, its n-links to the neighbors
+ being moved from their t-weights, or from sourceToSinkW, to new edges. tWeights holds the
+ t-weights of p when it was merged, whose cut part is removed from sourceToSinkW.
+ With dynamic, the capacities are updated so that the residual graph of a solved graph can be
+ reused by maxFlow(true). Otherwise only the vertex and its edges are added, all the capacities
+ having to be rewritten by setGCGraphWeights_slim.
+*/
+template <int Conn, class TIndex, class TCap>
+static void releasePixel_slim( Point p, const Vec2d& tw, bool dynamic, const Mat* nW[4], const Mat& tWeights,
+	GCGraph<double, TIndex, TCap>& graph, Mat& pxl2Vtx, Mat& pxl2Edge )
+{
+	int l = pxl2Vtx.at<int>(p);
+	int r, alt_r;
+	vtxRegions_slim(p, pxl2Vtx.size(), r, alt_r);
+	int vtx = (int)graph.addVtx(r, alt_r);
+	if (dynamic)
+	{
+		graph.sourceToSinkW -= jfg(l) ? tWeights.at<Vec2d>(p)[1] : tWeights.at<Vec2d>(p)[0];
+		graph.updateTermWeights(vtx, tw[0], tw[1]);
+	}
+	for (int k = 0; k < 8; k += 8 / Conn)
+	{
+		Point q(p.x + nbr_dx[k], p.y + nbr_dy[k]);
+		if (q.x < 0 || q.x >= pxl2Vtx.cols || q.y < 0 || q.y >= pxl2Vtx.rows)
+			continue;
+		double w = (k < 4) ? nW[k]->at<double>(p) : nW[k - 4]->at<double>(q);
+		int n = pxl2Vtx.at<int>(q);
+		if (n >= 0)
+		{
+			if (dynamic)
+				graph.updateTermWeights(n, (jfg(l) ? -w : 0), (jbg(l) ? -w : 0));
+			TIndex e = graph.addEdges(vtx, n, w, w);
+			if (k < 4)
+				pixelEdges<TIndex>(pxl2Edge, p)[k] = e;
+			else
+				pixelEdges<TIndex>(pxl2Edge, q)[k - 4] = e;
+		}
+		else if (dynamic)
+		{
+			if (jbg(l) != jbg(n))
+				graph.sourceToSinkW -= w;
+			graph.updateTermWeights(vtx, (jfg(n) ? w : 0), (jbg(n) ? w : 0));
+		}
+	}
+	pxl2Vtx.at<int>(p) = vtx;
+}
+
+/*
+ Update a graph built by constructGCGraph_slim and already solved, for new GMMs. Only the
+ GMM part of the t-weights changes, the n-weights are unchanged, so the vertices and edges of
+ the graph are kept.
+ The pixels merged with a terminal node which are still merged with the same terminal by the
+ reduction computed for the new t-weights stay merged, since fixing a subset of persistent
+ labels keeps the min cut. The other ones are released: they are added to the graph as new
+ vertices.
+ When all the t-weights are finite, the graph is updated by differences (dynamic graph cuts)
+ and true is returned: the residual graph is kept, and the max flow is resumed with
+ maxFlow(true). Otherwise (zero GMM probability), all the capacities are rewritten and false
+ is returned: the max flow has to be computed from a null flow.
+ When the new reduction leaves less than half of the vertices, a new graph is built instead
+ and false is returned.
+ On output joined is the number of GC_PR_BGD or GC_PR_FGD pixels merged with a terminal node,
+ and joinRank the order of the joins of the new reduction, which the pixels still merged follow.
+ lbl and newTWeights are scratch matrices, which the caller keeps from an update to the next one.
+*/
+template <int Conn, class TIndex, class TCap, int K>
+static bool updateGCGraph_slim( const Mat& img, const Mat& mask, const GMM<K>& bgdGMM, const GMM<K>& fgdGMM, double lambda,
+	const Mat& leftW, const Mat& upleftW, const Mat& upW, const Mat& uprightW,
+	GCGraph<double, TIndex, TCap>& graph, Mat& pxl2Vtx, Mat& pxl2Edge, Mat& tWeights, Mat& lbl, Mat& newTWeights,
+	int& joined, Mat* joinRank = 0 )
+{
+	const Mat* nW[4] = { &leftW, &upleftW, &upW, &uprightW };
+	lbl.create(img.size(), CV_32SC1);
+	double sourceToSinkW = 0;
+	joined = reduceGCGraph_slim<Conn>(img, mask, bgdGMM, fgdGMM, lambda, leftW, upleftW, upW, uprightW, lbl, newTWeights, sourceToSinkW, joinRank);
+
+	// when the new reduction removes most of the vertices, a new graph is smaller
+	Point p;
+	int vtxCount = 0;
+	for (p.y = 0; p.y < img.rows; p.y++)
+		for (p.x = 0; p.x < img.cols; p.x++)
+			vtxCount += lbl.at<int>(p) >= 0;
+	if (2 * vtxCount < graph.vtxCount())
+	{
+		graph.clear();
+		graph.sourceToSinkW = sourceToSinkW;
+		std::swap(pxl2Vtx, lbl);
+		std::swap(tWeights, newTWeights);
+		buildGCGraph_slim<Conn>(img, leftW, upleftW, upW, uprightW, graph, pxl2Vtx, pxl2Edge, tWeights);
+		return false;
+	}
+
+	// infinite t-weights cannot be updated by differences
+	bool dynamic = true;
+	for (p.y = 0; p.y < img.rows && dynamic; p.y++)
+	{
+		for (p.x = 0; p.x < img.cols; p.x++)
+		{
+			uchar m = mask.at<uchar>(p);
+			if (m != GC_PR_BGD && m != GC_PR_FGD)
+				continue;
+			int vtx = pxl2Vtx.at<int>(p);
+			const Vec2d& tw = tWeights.at<Vec2d>(p);
+			const Vec2d& ntw = newTWeights.at<Vec2d>(p);
+			if (vtx >= 0)
+				dynamic = fabs(ntw[0] - tw[0]) <= DBL_MAX && fabs(ntw[1] - tw[1]) <= DBL_MAX;
+			else if (lbl.at<int>(p) != vtx)
+				dynamic = fabs(ntw[0]) <= DBL_MAX && fabs(ntw[1]) <= DBL_MAX && fabs(jfg(vtx) ? tw[1] : tw[0]) <= DBL_MAX;
+			else // only the cut t-weight of a merged pixel is used
+				dynamic = fabs(jfg(vtx) ? ntw[1] - tw[1] : ntw[0] - tw[0]) <= DBL_MAX;
+			if (!dynamic)
+				break;
+		}
+	}
+
+	joined = 0;
+	for (p.y = 0; p.y < img.rows && dynamic; p.y++)
+	{
+		for (p.x = 0; p.x < img.cols; p.x++)
+		{
+			uchar m = mask.at<uchar>(p);
+			if (m != GC_PR_BGD && m != GC_PR_FGD)
+				continue;
+			Vec2d dw = newTWeights.at<Vec2d>(p) - tWeights.at<Vec2d>(p);
+			int vtx = pxl2Vtx.at<int>(p);
+			if (vtx >= 0)
+				graph.updateTermWeights(vtx, dw[0], dw[1]);
+			else if (lbl.at<int>(p) == vtx)
+			{
+				graph.sourceToSinkW += jfg(vtx) ? dw[1] : dw[0];
+				joined++;
+			}
+		}
+	}
+
+	// release the pixels whose label is not persistent any more
+	for (p.y = 0; p.y < img.rows; p.y++)
+		for (p.x = 0; p.x < img.cols; p.x++)
+			if (pxl2Vtx.at<int>(p) < 0 && lbl.at<int>(p) != pxl2Vtx.at<int>(p))
+				releasePixel_slim<Conn>(p, newTWeights.at<Vec2d>(p), dynamic, nW, tWeights, graph, pxl2Vtx, pxl2Edge);
+	std::swap(tWeights, newTWeights);
+
+	if (!dynamic)
+		joined = setGCGraphWeights_slim<Conn>(mask, leftW, upleftW, upW, uprightW, pxl2Vtx, pxl2Edge, tWeights, graph);
+	return dynamic;
+}
+
+/*
+ Set the labels of the GC_PR_BGD or GC_PR_FGD pixels from the min cut of the reduced graph.
+ Each band of rows is written by its own thread.
+*/
+template <class TIndex, class TCap>
+static void setMask_slim( GCGraph<double, TIndex, TCap>& graph, Mat& mask, const Mat& ptx2Vtx )
+{
+	parallelRows(mask.rows, [&](int y0, int y1)
+	{
+		Point p;
+		for (p.y = y0; p.y < y1; p.y++)
+		{
+			for (p.x = 0; p.x < mask.cols; p.x++)
+			{
+				if (mask.at<uchar>(p) == GC_PR_BGD || mask.at<uchar>(p) == GC_PR_FGD)
+				{
+					int v = ptx2Vtx.at<int>(p);
+					if (v == GC_JNT_BGD)
+						mask.at<uchar>(p) = GC_PR_BGD;
+					else if (v == GC_JNT_FGD)
+						mask.at<uchar>(p) = GC_PR_FGD;
+					else if (graph.inSourceSegment(v))
+						mask.at<uchar>(p) = GC_PR_FGD;
+					else
+						mask.at<uchar>(p) = GC_PR_BGD;
+				}
+			}
+		}
+	});
+}
+
+/*
+ Multithreaded estimateSegmentation with reduced graph
+*/
+template <class TIndex, class TCap>
+static double estimateSegmentation_slim( GCGraph<double, TIndex, TCap>& graph, Mat& mask, const Mat& ptx2Vtx )
+{   
+	// parallel partial max flow computations, on the regions then on the alternate regions
+	regionsMaxFlow(graph, 0);
+	regionsMaxFlow(graph, 1);
+
+	// last call using the whole residual graph, whose flow includes the partial ones
+	double flow = graph.maxFlow();
+
+	setMask_slim(graph, mask, ptx2Vtx);
+	return flow;
+}
+
+/*
+ Energy of the segmentation given by mask: the t-weights of the GC_PR_BGD or GC_PR_FGD pixels cut
+ by the segmentation, computed from the GMMs or read from tWeights when given, plus the n-weights
+ of the pairs of neighbors with different labels. The pixels marked as BG or FG are not cut.
+*/
+template <int K>
+static double segmentationEnergy( const Mat& img, const Mat& mask, const GMM<K>& bgdGMM, const GMM<K>& fgdGMM, const Mat* tWeights,
+	const Mat& leftW, const Mat& upleftW, const Mat& upW, const Mat& uprightW )
+{
+	const Mat* nW[4] = { &leftW, &upleftW, &upW, &uprightW };
+	std::mutex mtx;
+	double energy = 0;
+
+	parallelRows(mask.rows, [&](int y0, int y1)
+	{
+		double e = 0;
+		Point p;
+		for (p.y = y0; p.y < y1; p.y++)
+		{
+			for (p.x = 0; p.x < mask.cols; p.x++)
+			{
+				uchar m = mask.at<uchar>(p);
+				if (m == GC_PR_BGD)
+					e += tWeights ? tWeights->at<Vec2d>(p)[0] : -log(bgdGMM(img.at<Vec3b>(p)));
+				else if (m == GC_PR_FGD)
+					e += tWeights ? tWeights->at<Vec2d>(p)[1] : -log(fgdGMM(img.at<Vec3b>(p)));
+				for (int k = 0; k < 4; k++)
+				{
+					Point q(p.x + nbr_dx[k], p.y + nbr_dy[k]);
+					if (q.x >= 0 && q.x < mask.cols && q.y >= 0 && ((mask.at<uchar>(q) ^ m) & 1))
+						e += nW[k]->at<double>(p);
+				}
+			}
+		}
+		std::lock_guard<std::mutex> lk(mtx);
+		energy += e;
+	});
+	return energy;
+}
+
+/*
+ Returns the number of GC_PR_BGD or GC_PR_FGD pixels whose label differs in mask and prevMask,
+ prCount receiving the number of GC_PR_BGD or GC_PR_FGD pixels.
+*/
+static int changedLabels( const Mat& mask, const Mat& prevMask, int& prCount )
+{
+	std::mutex mtx;
+	int changed = 0;
+
+	prCount = 0;
+	parallelRows(mask.rows, [&](int y0, int y1)
+	{
+		int c = 0, n = 0;
+		for (int y = y0; y < y1; y++)
+		{
+			for (int x = 0; x < mask.cols; x++)
+			{
+				uchar m = mask.at<uchar>(y, x);
+				if (m != GC_PR_BGD && m != GC_PR_FGD)
+					continue;
+				n++;
+				c += m != prevMask.at<uchar>(y, x);
+			}
+		}
+		std::lock_guard<std::mutex> lk(mtx);
+		changed += c;
+		prCount += n;
+	});
+	return changed;
+}
+
+/*
+ Progressive freezing of the GC_PR_BGD or GC_PR_FGD pixels (see GrabCutParams::freezeIterations).
+ stable (CV_32SC1) counts the consecutive iterations for which each pixel kept its label, the
+ frozen pixels having -1. A pixel which kept its label for iterations iterations, and whose
+ t-weights (when given) favor this label by at least margin, is marked as GC_BGD or GC_FGD, so
+ that the next reduction merges it with a terminal node.
+ Returns the number of pixels frozen.
+*/
+static int freezeStablePixels( Mat& mask, const Mat& prevMask, const Mat* tWeights, Mat& stable,
+	int iterations, double margin )
+{
+	std::mutex mtx;
+	int frozen = 0;
+
+	parallelRows(mask.rows, [&](int y0, int y1)
+	{
+		int count = 0;
+		for (int y = y0; y < y1; y++)
+		{
+			for (int x = 0; x < mask.cols; x++)
+			{
+				uchar& m = mask.at<uchar>(y, x);
+				if (m != GC_PR_BGD && m != GC_PR_FGD)
+					continue;
+				int& n = stable.at<int>(y, x);
+				n = (m == prevMask.at<uchar>(y, x)) ? n + 1 : 0;
+				if (!tWeights || n < iterations)
+					continue;
+				const Vec2d& tw = tWeights->at<Vec2d>(y, x);
+				if ((m == GC_PR_FGD ? tw[0] - tw[1] : tw[1] - tw[0]) < margin)
+					continue;
+				m = (m == GC_PR_FGD) ? GC_FGD : GC_BGD;
+				n = -1;
+				count++;
+			}
+		}
+		std::lock_guard<std::mutex> lk(mtx);
+		frozen += count;
+	});
+	return frozen;
+}
+
+/*
+ Give back their GC_PR_BGD or GC_PR_FGD class to the pixels frozen by freezeStablePixels.
+*/
+static void thawPixels( Mat& mask, const Mat& stable )
+{
+	parallelRows(mask.rows, [&](int y0, int y1)
+	{
+		for (int y = y0; y < y1; y++)
+			for (int x = 0; x < mask.cols; x++)
+				if (stable.at<int>(y, x) < 0)
+					mask.at<uchar>(y, x) = (mask.at<uchar>(y, x) == GC_FGD) ? GC_PR_FGD : GC_PR_BGD;
+	});
+}
+
+/*
+ Distance (CV_32FC1) of each pixel to the boundary of the segmentation given by mask, i.e. to
+ the pixels having a 4-neighbor with the other label
+*/
+static void boundaryDistance( const Mat& mask, Mat& dist )
+{
+	Mat notBoundary(mask.size(), CV_8UC1);
+	parallelRows(mask.rows, [&](int y0, int y1)
+	{
+		for (int y = y0; y < y1; y++)
+		{
+			for (int x = 0; x < mask.cols; x++)
+			{
+				uchar l = mask.at<uchar>(y, x) & 1;
+				bool b = (x > 0 && (mask.at<uchar>(y, x - 1) & 1) != l) ||
+					(x + 1 < mask.cols && (mask.at<uchar>(y, x + 1) & 1) != l) ||
+					(y > 0 && (mask.at<uchar>(y - 1, x) & 1) != l) ||
+					(y + 1 < mask.rows && (mask.at<uchar>(y + 1, x) & 1) != l);
+				notBoundary.at<uchar>(y, x) = b ? 0 : 255;
+			}
+		}
+	});
+	distanceTransform(notBoundary, dist, DIST_L2, DIST_MASK_3);
+}
+
+/*
+ Narrow band iteration. The GC_PR_BGD or GC_PR_FGD pixels farther than bandWidth from the
+ boundary of the current segmentation keep their label: they are marked as BG or FG in a copy
+ of the mask, so the reduced graph of constructGCGraph_slim only covers the band.
+ When the new boundary reaches the edge of the band, i.e. a pixel of the band gets a label
+ different from the one of a fixed neighbor, the labels outside of the band may change too:
+ the mask is left unchanged and false is returned.
+ On output vtxCount and joined describe the reduced graph of the band, whose n-links are those
+ of the connectivity Conn. The graph and the matrices bandMask, dist, pxl2Vtx, pxl2Edge and
+ tWeights are those of the caller, so that their memory is kept between the iterations.
+*/
+template <int Conn, int K>
+static bool estimateSegmentation_band( const Mat& img, Mat& mask, const GMM<K>& bgdGMM, const GMM<K>& fgdGMM, double lambda,
+	const Mat& leftW, const Mat& upleftW, const Mat& upW, const Mat& uprightW, int bandWidth, GCGraph<double>& graph,
+	Mat& bandMask, Mat& dist, Mat& pxl2Vtx, Mat& pxl2Edge, Mat& tWeights, int& vtxCount, int& joined )
+{
+	boundaryDistance(mask, dist);
+
+	mask.copyTo(bandMask);
+	parallelRows(mask.rows, [&](int y0, int y1)
+	{
+		for (int y = y0; y < y1; y++)
+		{
+			for (int x = 0; x < mask.cols; x++)
+			{
+				uchar& m = bandMask.at<uchar>(y, x);
+				if ((m == GC_PR_BGD || m == GC_PR_FGD) && dist.at<float>(y, x) > bandWidth)
+					m = (m == GC_PR_FGD) ? GC_FGD : GC_BGD;
+			}
+		}
+	});
+
+	graph.clear();
+	joined = constructGCGraph_slim<Conn>(img, bandMask, bgdGMM, fgdGMM, lambda, leftW, upleftW, upW, uprightW, graph, pxl2Vtx, pxl2Edge, tWeights);
+	vtxCount = graph.vtxCount();
+	estimateSegmentation_slim(graph, bandMask, pxl2Vtx);
+
+	// the pixels of the band are the GC_PR_BGD or GC_PR_FGD pixels of bandMask
+	Point p;
+	for (p.y = 0; p.y < mask.rows; p.y++)
+	{
+		for (p.x = 0; p.x < mask.cols; p.x++)
+		{
+			uchar b = bandMask.at<uchar>(p);
+			if (b != GC_PR_BGD && b != GC_PR_FGD)
+				continue;
+			for (int k = 0; k < 8; k += 8 / Conn)
+			{
+				Point q(p.x + nbr_dx[k], p.y + nbr_dy[k]);
+				if (q.x < 0 || q.x >= mask.cols || q.y < 0 || q.y >= mask.rows)
+					continue;
+				uchar m = mask.at<uchar>(q), bq = bandMask.at<uchar>(q);
+				if ((m == GC_PR_BGD || m == GC_PR_FGD) && (bq == GC_BGD || bq == GC_FGD) && (bq & 1) != (b & 1))
+					return false;
+			}
+		}
+	}
+
+	for (p.y = 0; p.y < mask.rows; p.y++)
+	{
+		for (p.x = 0; p.x < mask.cols; p.x++)
+		{
+			uchar b = bandMask.at<uchar>(p);
+			if (b == GC_PR_BGD || b == GC_PR_FGD)
+				mask.at<uchar>(p) = b;
+		}
+	}
+	return true;
+}
+
+/*
+ Multithreaded version of grabCut
+ Pixels whose label is fixed by the persistency test are removed from the graph
+*/
+void cv::grabCut(InputArray _img, InputOutputArray _mask, Rect rect,
+	InputOutputArray _bgdModel, InputOutputArray _fgdModel,
+	int iterCount, int mode)
+{
+	grabCut(_img, _mask, rect, _bgdModel, _fgdModel, iterCount, mode, 0);
+}
+
+void cv::grabCut(InputArray _img, InputOutputArray _mask, Rect rect,
+	InputOutputArray _bgdModel, InputOutputArray _fgdModel,
+	int iterCount, int mode, GrabCutStats* stats)
+{
+	grabCut(_img, _mask, rect, _bgdModel, _fgdModel, iterCount, mode, GrabCutParams(), stats);
+}
+
+cv::GrabCutParams::GrabCutParams() : bandWidth(0), pyramidLevels(0), superpixelSize(0), freezeIterations(0), freezeMargin(2),
+	quantizeCapacities(false), connectivity(8)
+{
+}
+
+static void runGrabCut( const Mat& img, Mat& mask, Rect rect, Mat& bgdModel, Mat& fgdModel, int iterCount,
+	int mode, const GrabCutParams& params, GrabCutStats* stats, GrabCutWorkspace* workspace );
+
+/*
+ Last step of the approximate modes: the GC_PR_BGD or GC_PR_FGD pixels get the label of
+ approxMask, those farther than bandWidth from its boundary being temporarily marked as BG or
+ FG, so that the reduced graph of one GC_EVAL iteration at full resolution only covers the band
+ around the boundary. The iteration runs with the params of the caller, the approximate modes
+ aside, and on its workspace.
+ flags holds the flags combined with the mode, e.g. GC_ROI_ONLY.
+*/
+static void refineBoundary( const Mat& img, Mat& mask, const Mat& approxMask, float bandWidth,
+	Mat& bgdModel, Mat& fgdModel, int flags, const GrabCutParams& params, GrabCutStats* stats,
+	GrabCutWorkspace* workspace )
+{
+	GrabCutParams fineParams = params;
+	fineParams.bandWidth = 0;
+	fineParams.pyramidLevels = 0;
+	fineParams.superpixelSize = 0;
+
+	// the matrices only cover the GC_PR_BGD or GC_PR_FGD pixels, and the distances are only needed
+	// up to bandWidth: the boundary pixels farther than margin do not change them, the chamfer
+	// distance of distanceTransform being at least 0.955 times the chessboard distance
+	Rect roi = uncertainROI(mask);
+	if (roi.area() == 0)
+	{
+		runGrabCut(img, mask, Rect(), bgdModel, fgdModel, 1, GC_EVAL | flags, fineParams, stats, workspace);
+		return;
+	}
+	int margin = cvCeil(bandWidth / 0.955f) + 2;
+	Rect area = Rect(roi.x - margin, roi.y - margin, roi.width + 2 * margin, roi.height + 2 * margin) &
+		Rect(0, 0, img.cols, img.rows);
+	Mat dist;
+	boundaryDistance(approxMask(area), dist);
+	dist = dist(Rect(roi.x - area.x, roi.y - area.y, roi.width, roi.height));
+
+	// label the GC_PR_BGD or GC_PR_FGD pixels, fixing the ones far from the boundary
+	Mat roiMask = mask(roi), fixed(roi.size(), CV_8UC1);
+	parallelRows(roi.height, [&](int y0, int y1)
+	{
+		for (int y = y0; y < y1; y++)
+		{
+			for (int x = 0; x < roi.width; x++)
+			{
+				uchar& m = roiMask.at<uchar>(y, x);
+				uchar& f = fixed.at<uchar>(y, x);
+				f = 0;
+				if (m != GC_PR_BGD && m != GC_PR_FGD)
+					continue;
+				bool fgd = (approxMask.at<uchar>(roi.y + y, roi.x + x) & 1) != 0;
+				f = dist.at<float>(y, x) > bandWidth;
+				if (f)
+					m = fgd ? GC_FGD : GC_BGD;
+				else
+					m = fgd ? GC_PR_FGD : GC_PR_BGD;
+			}
+		}
+	});
+
+	runGrabCut(img, mask, Rect(), bgdModel, fgdModel, 1, GC_EVAL | flags, fineParams, stats, workspace);
+
+	// the energy of the iteration covers the n-links, but only the data terms of the band: the ones
+	// of the fixed pixels are added as they get their GC_PR_BGD or GC_PR_FGD label back
+	GMM<> bgdGMM(bgdModel), fgdGMM(fgdModel);
+	std::mutex mtx;
+	parallelRows(roi.height, [&](int y0, int y1)
+	{
+		double e = 0;
+		for (int y = y0; y < y1; y++)
+		{
+			for (int x = 0; x < roi.width; x++)
+			{
+				if (!fixed.at<uchar>(y, x))
+					continue;
+				uchar& m = roiMask.at<uchar>(y, x);
+				m = (m == GC_FGD) ? GC_PR_FGD : GC_PR_BGD;
+				if (stats)
+				{
+					Vec3d color = img.at<Vec3b>(roi.y + y, roi.x + x);
+					e -= log(m == GC_PR_FGD ? fgdGMM(color) : bgdGMM(color));
+				}
+			}
+		}
+		std::lock_guard<std::mutex> lk(mtx);
+		if (stats)
+			stats->energy += e;
+	});
+}
+
+/*
+ Coarse-to-fine GrabCut: the iterations run on the image downsampled levels times, then the
+ labels are upsampled and refined at full resolution around their boundary, see refineBoundary.
+*/
+static void grabCut_pyramid( const Mat& img, Mat& mask, Mat& bgdModel, Mat& fgdModel, int iterCount, int mode,
+	int flags, int levels, const GrabCutParams& params, GrabCutStats* stats, GrabCutWorkspace* workspace )
+{
+	Size coarseSize(img.cols >> levels, img.rows >> levels);
+	Mat coarseImg, coarseMask;
+	resize(img, coarseImg, coarseSize, 0, 0, INTER_AREA);
+	resize(mask, coarseMask, coarseSize, 0, 0, INTER_NEAREST);
+
+	GrabCutParams coarseParams = params;
+	GrabCutStats coarseStats;
+	coarseParams.pyramidLevels = 0;
+	runGrabCut(coarseImg, coarseMask, Rect(), bgdModel, fgdModel, iterCount,
+		(mode == GC_EVAL ? GC_EVAL : GC_INIT_WITH_MASK) | flags, coarseParams, &coarseStats, workspace);
+
+	Mat upMask;
+	resize(coarseMask, upMask, img.size(), 0, 0, INTER_NEAREST);
+	const float bandWidth = params.bandWidth > 0 ? (float)params.bandWidth : (float)(2 << levels);
+	refineBoundary(img, mask, upMask, bandWidth, bgdModel, fgdModel, flags, params, stats, workspace);
+	if (stats)
+		stats->iterations += coarseStats.iterations;
+}
+/*
+ Class of a pixel for the superpixels: GC_PR_BGD for the GC_PR_BGD or GC_PR_FGD pixels,
+ which may change label, and the mask value for the other ones.
+*/
+static inline uchar superpixelClass( uchar m )
+{
+	return (m == GC_PR_FGD) ? (uchar)GC_PR_BGD : m;
+}
+
+/*
+ SLIC superpixels (Achanta et al.), clustered in the color space of the image: the cluster
+ centers start on a grid of step regionSize, and each pixel is assigned to the closest center
+ among those of the 3x3 neighboring grid cells, for the distance
+ 2 beta |color|^2 + |position / regionSize|^2. The colors are scaled by beta (see calcBeta),
+ i.e. by the mean difference between neighbors, so that the noise of the image does not break
+ the superpixels.
+ The clusters are then split into connected components of pixels of the same superpixelClass,
+ the components smaller than a quarter of a cell being merged with a neighboring component of
+ the same class.
+ On output labels (CV_32SC1) holds the superpixel of each pixel.
+ Returns the number of superpixels.
+*/
+static int slicSuperpixels( const Mat& img, const Mat& mask, int regionSize, double beta, Mat& labels )
+{
+	const int slicIterCount = 5;
+	const int nx = std::max(img.cols / regionSize, 1), ny = std::max(img.rows / regionSize, 1);
+	const double cellW = (double)img.cols / nx, cellH = (double)img.rows / ny;
+	const double colorW = 2 * beta, posW = 1. / (regionSize * regionSize);
+	std::mutex mtx;
+
+	// cluster centers: b, g, r, x, y
+	std::vector<Vec<double, 5> > centers(nx * ny);
+	for (int cy = 0; cy < ny; cy++)
+	{
+		for (int cx = 0; cx < nx; cx++)
+		{
+			int x = std::min(cvFloor((cx + 0.5) * cellW), img.cols - 1), y = std::min(cvFloor((cy + 0.5) * cellH), img.rows - 1);
+			Vec3b color = img.at<Vec3b>(y, x);
+			Vec<double, 5>& c = centers[cy * nx + cx];
+			c[0] = color[0]; c[1] = color[1]; c[2] = color[2]; c[3] = x; c[4] = y;
+		}
+	}
+
+	labels.create(img.size(), CV_32SC1);
+	for (int iter = 0; iter < slicIterCount; iter++)
+	{
+		std::vector<Vec<double, 5> > sums(centers.size());
+		std::vector<int> counts(centers.size(), 0);
+		parallelRows(img.rows, [&](int y0, int y1)
+		{
+			std::vector<Vec<double, 5> > bandSums(centers.size());
+			std::vector<int> bandCounts(centers.size(), 0);
+			for (int y = y0; y < y1; y++)
+			{
+				int gy = std::min((int)(y / cellH), ny - 1);
+				for (int x = 0; x < img.cols; x++)
+				{
+					int gx = std::min((int)(x / cellW), nx - 1);
+					Vec3b color = img.at<Vec3b>(y, x);
+					int best = -1;
+					double bestD = DBL_MAX;
+					for (int cy = std::max(gy - 1, 0); cy <= std::min(gy + 1, ny - 1); cy++)
+					{
+						for (int cx = std::max(gx - 1, 0); cx <= std::min(gx + 1, nx - 1); cx++)
+						{
+							const Vec<double, 5>& c = centers[cy * nx + cx];
+							double db = color[0] - c[0], dg = color[1] - c[1], dr = color[2] - c[2];
+							double dx = x - c[3], dy = y - c[4];
+							double d = colorW * (db*db + dg*dg + dr*dr) + posW * (dx*dx + dy*dy);
+							if (d < bestD)
+							{
+								bestD = d;
+								best = cy * nx + cx;
+							}
+						}
+					}
+					labels.at<int>(y, x) = best;
+					Vec<double, 5>& s = bandSums[best];
+					s[0] += color[0]; s[1] += color[1]; s[2] += color[2]; s[3] += x; s[4] += y;
+					bandCounts[best]++;
+				}
+			}
+			std::lock_guard<std::mutex> lk(mtx);
+			for (size_t k = 0; k < centers.size(); k++)
+			{
+				sums[k] += bandSums[k];
+				counts[k] += bandCounts[k];
+			}
+		});
+		for (size_t k = 0; k < centers.size(); k++)
+			if (counts[k] > 0)
+				centers[k] = sums[k] * (1. / counts[k]);
+	}
+
+	// connected components, the small ones being merged with the component of a previous neighbor
+	const int minSize = std::max(regionSize * regionSize / 4, 1);
+	const int dx4[4] = { -1, 0, 1, 0 }, dy4[4] = { 0, -1, 0, 1 };
+	Mat components(img.size(), CV_32SC1, Scalar(-1));
+	std::vector<Point> comp;
+	int count = 0;
+	Point p;
+	for (p.y = 0; p.y < img.rows; p.y++)
+	{
+		for (p.x = 0; p.x < img.cols; p.x++)
+		{
+			if (components.at<int>(p) >= 0)
+				continue;
+			int l = labels.at<int>(p);
+			uchar cls = superpixelClass(mask.at<uchar>(p));
+			int adjacent = -1;
+			for (int k = 0; k < 2; k++)
+			{
+				Point q(p.x + dx4[k], p.y + dy4[k]);
+				if (q.x >= 0 && q.y >= 0 && superpixelClass(mask.at<uchar>(q)) == cls)
+					adjacent = components.at<int>(q);
+			}
+			comp.clear();
+			comp.push_back(p);
+			components.at<int>(p) = count;
+			for (size_t i = 0; i < comp.size(); i++)
+			{
+				for (int k = 0; k < 4; k++)
+				{
+					Point q(comp[i].x + dx4[k], comp[i].y + dy4[k]);
+					if (q.x < 0 || q.x >= img.cols || q.y < 0 || q.y >= img.rows || components.at<int>(q) >= 0 ||
+						labels.at<int>(q) != l || superpixelClass(mask.at<uchar>(q)) != cls)
+						continue;
+					components.at<int>(q) = count;
+					comp.push_back(q);
+				}
+			}
+			if ((int)comp.size() < minSize && adjacent >= 0)
+			{
+				for (size_t i = 0; i < comp.size(); i++)
+					components.at<int>(comp[i]) = adjacent;
+			}
+			else
+				count++;
+		}
+	}
+	labels = components;
+	return count;
+}
+
+/*
+ Pixels of a superpixel: their superpixelClass, count, and the sums of their colors and of the
+ products of their colors (for GMM::addSamples).
+*/
+struct SuperpixelStats
+{
+	uchar cls;
+	int count;
+	double sum[3];
+	double prod[3][3];
+};
+
+/*
+ GrabCut on superpixels (see slicSuperpixels): each superpixel of GC_PR_BGD or GC_PR_FGD pixels
+ is a vertex of the graph, and its n-links are the sums of the n-links between its pixels and
+ the pixels of the neighboring superpixels, those to the superpixels marked as BG or FG being
+ added to its t-weights. The GMMs are learned from the superpixels, all the pixels of a
+ superpixel being assigned to the component of their mean color, and the t-weights of a
+ superpixel are those of its mean color times its size. The labels are then refined around
+ their boundary at full resolution, see refineBoundary.
+*/
+static void grabCut_superpixel( const Mat& img, Mat& mask, Mat& bgdModel, Mat& fgdModel, int iterCount, int mode,
+	int flags, const GrabCutParams& params, GrabCutStats* stats, GrabCutWorkspace* workspace )
+{
+	GMM<> bgdGMM(bgdModel), fgdGMM(fgdModel);
+	if (mode == GC_INIT_WITH_RECT || mode == GC_INIT_WITH_MASK)
+		initGMMs(img, mask, bgdGMM, fgdGMM);
+
+	const double gamma = 50;
+	const double lambda = 9 * gamma;
+	Mat leftW, upleftW, upW, uprightW;
+	const double beta = calcBetaAndNWeights(img, params.connectivity, leftW, upleftW, upW, uprightW, gamma);
+	const Mat* nW[4] = { &leftW, &upleftW, &upW, &uprightW };
+	const int nbrStep = 8 / params.connectivity;
+
+	Mat labels;
+	const int spCount = slicSuperpixels(img, mask, params.superpixelSize, beta, labels);
+
+	// statistics of the superpixels, their adjacency, and the n-links to the ones marked as BG or FG
+	std::vector<SuperpixelStats> sp(spCount);
+	memset(&sp[0], 0, spCount * sizeof(SuperpixelStats));
+	std::vector<std::vector<std::pair<int, double> > > adjacency(spCount);
+	std::vector<Vec2d> hardW(spCount);
+	Point p;
+	for (p.y = 0; p.y < img.rows; p.y++)
+	{
+		for (p.x = 0; p.x < img.cols; p.x++)
+		{
+			int a = labels.at<int>(p);
+			SuperpixelStats& s = sp[a];
+			Vec3d color = img.at<Vec3b>(p);
+			s.cls = superpixelClass(mask.at<uchar>(p));
+			s.count++;
+			for (int i = 0; i < 3; i++)
+			{
+				s.sum[i] += color[i];
+				for (int j = 0; j < 3; j++)
+					s.prod[i][j] += color[i] * color[j];
+			}
+
+			for (int k = 0; k < 4; k += nbrStep)
+			{
+				Point q(p.x + nbr_dx[k], p.y + nbr_dy[k]);
+				if (q.x < 0 || q.x >= img.cols || q.y < 0)
+					continue;
+				int b = labels.at<int>(q);
+				if (a == b)
+					continue;
+				uchar ca = s.cls, cb = superpixelClass(mask.at<uchar>(q));
+				double w = nW[k]->at<double>(p);
+				if (ca != GC_PR_BGD && cb != GC_PR_BGD)
+					continue;
+				if (ca != GC_PR_BGD || cb != GC_PR_BGD)
+				{
+					uchar m = (ca != GC_PR_BGD) ? ca : cb;
+					hardW[ca != GC_PR_BGD ? b : a] += (m == GC_FGD) ? Vec2d(w, 0) : Vec2d(0, w);
+					continue;
+				}
+				std::vector<std::pair<int, double> >& adj = adjacency[std::min(a, b)];
+				int c = std::max(a, b);
+				size_t i = 0;
+				while (i < adj.size() && adj[i].first != c)
+					i++;
+				if (i < adj.size())
+					adj[i].second += w;
+				else
+					adj.push_back(std::make_pair(c, w));
+			}
+		}
+	}
+
+	// the graph is built once, its capacities are rewritten at each iteration
+	GCGraph<double> graph;
+	std::vector<int> sp2Vtx(spCount, -1), vtx2Sp;
+	std::vector<std::pair<int, double> > edgeWeights;
+	for (int a = 0; a < spCount; a++)
+	{
+		if (sp[a].cls != GC_PR_BGD)
+			continue;
+		sp2Vtx[a] = graph.addVtx();
+		vtx2Sp.push_back(a);
+	}
+	for (int a = 0; a < spCount; a++)
+	{
+		for (size_t i = 0; i < adjacency[a].size(); i++)
+		{
+			double w = adjacency[a][i].second;
+			edgeWeights.push_back(std::make_pair(graph.addEdges(sp2Vtx[a], sp2Vtx[adjacency[a][i].first], w, w), w));
+		}
+	}
+	adjacency.clear();
+	const int vtxCount = (int)vtx2Sp.size();
+
+	if (params.termCrit.type & TermCriteria::COUNT)
+		iterCount = std::min(iterCount, params.termCrit.maxCount);
+	const bool checkEps = (params.termCrit.type & TermCriteria::EPS) != 0;
+	int prCount = 0;
+	std::vector<uchar> spLabels(spCount);
+	for (int a = 0; a < spCount; a++)
+	{
+		spLabels[a] = sp[a].cls & 1;
+		if (sp[a].cls == GC_PR_BGD)
+			prCount += sp[a].count;
+	}
+	// the initial label of a superpixel is the one of its first pixel
+	for (p.y = img.rows - 1; p.y >= 0; p.y--)
+		for (p.x = img.cols - 1; p.x >= 0; p.x--)
+			spLabels[labels.at<int>(p)] = mask.at<uchar>(p) & 1;
+
+	int i = 0;
+	while (i < iterCount && vtxCount > 0)
+	{
+		bgdGMM.initLearning();
+		fgdGMM.initLearning();
+		for (int a = 0; a < spCount; a++)
+		{
+			const SuperpixelStats& s = sp[a];
+			Vec3d color(s.sum[0] / s.count, s.sum[1] / s.count, s.sum[2] / s.count);
+			GMM<>& gmm = spLabels[a] ? fgdGMM : bgdGMM;
+			gmm.addSamples(gmm.whichComponent(color), s.sum, s.prod, s.count);
+		}
+		bgdGMM.endLearning();
+		fgdGMM.endLearning();
+
+		// only the difference of the t-weights is kept, bounded by the weight of hard labels, so
+		// that a null GMM probability does not make it infinite
+		graph.resetFlow();
+		for (size_t e = 0; e < edgeWeights.size(); e++)
+			graph.setEdgeWeights(edgeWeights[e].first, edgeWeights[e].second, edgeWeights[e].second);
+		for (int v = 0; v < vtxCount; v++)
+		{
+			const SuperpixelStats& s = sp[vtx2Sp[v]];
+			Vec3d color(s.sum[0] / s.count, s.sum[1] / s.count, s.sum[2] / s.count);
+			double d = log(fgdGMM(color)) - log(bgdGMM(color));
+			d = (d != d) ? 0 : std::min(std::max(d, -lambda), lambda) * s.count;
+			const Vec2d& hw = hardW[vtx2Sp[v]];
+			graph.setTermWeights(v, hw[0] + std::max(d, 0.), hw[1] + std::max(-d, 0.));
+		}
+		graph.maxFlow();
+
+		int changed = 0;
+		for (int v = 0; v < vtxCount; v++)
+		{
+			int a = vtx2Sp[v];
+			uchar l = graph.inSourceSegment(v) ? 1 : 0;
+			if (l != spLabels[a])
+				changed += sp[a].count;
+			spLabels[a] = l;
+		}
+		i++;
+		if (checkEps && changed <= params.termCrit.epsilon * prCount)
+			break;
+	}
+
+	Mat approxMask(img.size(), CV_8UC1);
+	parallelRows(img.rows, [&](int y0, int y1)
+	{
+		for (int y = y0; y < y1; y++)
+			for (int x = 0; x < img.cols; x++)
+				approxMask.at<uchar>(y, x) = spLabels[labels.at<int>(y, x)] ? GC_PR_FGD : GC_PR_BGD;
+	});
+	const float bandWidth = params.bandWidth > 0 ? (float)params.bandWidth : (float)params.superpixelSize;
+	refineBoundary(img, mask, approxMask, bandWidth, bgdModel, fgdModel, flags, params, stats, workspace);
+	if (stats)
+		stats->iterations += i;
+}
+
+
+/*
+ Buffers of grabCut kept by a GrabCutWorkspace. They are blocks of an arena on which the solver
+ puts the matrices it needs (see take), so that they fit any image not larger than the largest
+ one segmented so far. The arrays of the graph come from the same arena, which keeps their blocks
+ when the graph is rebuilt larger, and puts the blocks in files of a storage directory past a
+ memory limit.
+*/
+namespace cv
+{
+
+class GrabCutWorkspaceImpl : public GrabCutWorkspace
+{
+public:
+	struct Buffer
+	{
+		Buffer() : ptr(0), size(0) {}
+		void* ptr;
+		size_t size;
+	};
+
+	GrabCutWorkspaceImpl(bool hugePages = false, const String& storageDir = String(), size_t memoryLimit = 0) :
+		arena(hugePages), graph(&arena), wideGraph(&arena), quantGraph(&arena), bandGraph(&arena)
+	{
+		arena.setNodes(GrabCutThreadPool::instance().nodeIds());
+		if (!storageDir.empty())
+			arena.setStorage(storageDir, memoryLimit);
+	}
+	~GrabCutWorkspaceImpl() { release(); }
+	void release();
+	size_t memoryUsage() const;
+	Mat take(Buffer& buffer, Size size, int type);
+
+	Buffer compIdxs, pxl2Vtx, pxl2Edge, tWeights, lbl, newTWeights;
+	Buffer leftW, upleftW, upW, uprightW;
+	Buffer prevMask, stable;
+	Buffer bandMask, bandDist, bandPxl2Vtx, bandPxl2Edge, bandTWeights;
+	GCGraphArena arena;
+	GCGraph<double> graph;
+	GCGraph<double, int64> wideGraph; // images past the edges of graph, see needsWideGCGraph
+	// 16-bit capacities, see GrabCutParams::quantizeCapacities. The edges of wideGraph would keep
+	// their size, padded to the alignment of the 64-bit indices.
+	GCGraph<double, int, ushort> quantGraph;
+	GCGraph<double> bandGraph; // see estimateSegmentation_band
+};
+
+void GrabCutWorkspaceImpl::release()
+{
+	Buffer* buffers[] = { &compIdxs, &pxl2Vtx, &pxl2Edge, &tWeights, &lbl, &newTWeights,
+		&leftW, &upleftW, &upW, &uprightW, &prevMask, &stable,
+		&bandMask, &bandDist, &bandPxl2Vtx, &bandPxl2Edge, &bandTWeights };
+	for (size_t k = 0; k < sizeof(buffers) / sizeof(buffers[0]); k++)
+	{
+		if (buffers[k]->ptr)
+			arena.deallocate(buffers[k]->ptr, buffers[k]->size);
+		*buffers[k] = Buffer();
+	}
+	graph.release();
+	wideGraph.release();
+	quantGraph.release();
+	bandGraph.release();
+	arena.release();
+}
+
+size_t GrabCutWorkspaceImpl::memoryUsage() const
+{
+	return graph.memoryUsage() + wideGraph.memoryUsage() + quantGraph.memoryUsage() + bandGraph.memoryUsage() +
+		arena.memoryUsage();
+}
+
+/*
+ Returns a continuous matrix of the given size and type on the memory of buffer, which is only
+ reallocated when it is too small. The matrix is valid until the next call with the same buffer.
+*/
+Mat GrabCutWorkspaceImpl::take(Buffer& buffer, Size size, int type)
+{
+	size_t bytes = (size_t)size.area() * CV_ELEM_SIZE(type);
+	if (buffer.size < bytes)
+	{
+		if (buffer.ptr)
+			arena.deallocate(buffer.ptr, buffer.size);
+		buffer = Buffer();
+		buffer.ptr = arena.allocate(bytes);
+		buffer.size = bytes;
+	}
+	return Mat(size, type, buffer.ptr);
+}
+
+}
+
+cv::Ptr<cv::GrabCutWorkspace> cv::createGrabCutWorkspace(bool hugePages, const String& storageDir, size_t memoryLimit)
+{
+	return makePtr<GrabCutWorkspaceImpl>(hugePages, storageDir, memoryLimit);
+}
+
+/*
+ State of a grabCut call between its phases, so that the phases of several calls can be
+ interleaved (see GrabCutPipeline):
+ prepare initializes the mask and the GMMs, and computes the n-weights, then each iteration runs
+ model (learning of the GMMs, construction or update of the graph) and solve (max flow, labels,
+ termination criteria and frozen pixels) until done, and finish completes the call.
+ The approximate modes (superpixels, pyramid) run entirely in prepare.
+ The matrices and the graph of the iterations are put on the buffers of workspace, when given.
+*/
+class GrabCutSolver
+{
+public:
+	GrabCutSolver( const Mat& img, Mat& mask, Rect rect, Mat& bgdModel, Mat& fgdModel,
+		int iterCount, int mode, const GrabCutParams& params, GrabCutStats* stats,
+		GrabCutWorkspace* workspace = 0 );
+
+	// returns false when the call is already complete
+	bool prepare();
+	void model();
+	void solve();
+	bool done() const { return i >= iterCount || converged; }
+	void finish();
+	// single row samples, labels and weight of the samples added to the pixels of the image to learn
+	// the GMMs, see contextGMMPixels. To be called before prepare.
+	void setContext( const Mat& samples, const Mat& labels, int weight )
+	{
+		contextSamples = samples;
+		contextLabels = labels;
+		contextWeight = weight;
+	}
+
+	// estimated memory of the matrices and the graph of the iterations of an image of the given size
+	static size_t memoryUsage( Size size, const GrabCutParams& params );
+
+private:
+	// the n-links are those of the connectivity Conn, see GrabCutParams::connectivity
+	template <int Conn> void modelConn();
+	template <int Conn, class TIndex, class TCap> void modelGraph( GCGraph<double, TIndex, TCap>& g );
+	template <class TIndex, class TCap> void solveGraph( GCGraph<double, TIndex, TCap>& g );
+
+	Ptr<GrabCutWorkspaceImpl> ownWorkspace; // only created when the caller gives no workspace
+	GrabCutWorkspaceImpl& workspace;
+	const Mat fullImg;
+	Mat& fullMask;
+	Mat& bgdModel;
+	Mat& fgdModel;
+	Rect rect;
+	int iterCount, mode, flags;
+	const GrabCutParams params;
+	GrabCutStats* stats;
+	GMM<> bgdGMM, fgdGMM;
+
+	Mat img, mask, gmmImg, gmmMask, gmmWeights, compIdxs;
+	Mat contextSamples, contextLabels;
+	int contextWeight;
+	double lambda;
+	Mat leftW, upleftW, upW, uprightW;
+
+	// the graph is wideGraph when its edges need 64-bit indices, otherwise quantGraph with
+	// quantized capacities
+	GCGraph<double>& graph;
+	GCGraph<double, int64>& wideGraph;
+	GCGraph<double, int, ushort>& quantGraph;
+	bool wide;
+	double quantum;
+	Mat pxl2Vtx, pxl2Edge, tWeights, lbl, newTWeights;
+	Mat bandMask, bandDist, bandPxl2Vtx, bandPxl2Edge, bandTWeights;
+	int eliminated;
+	bool reuse, inBand;
+
+	int i;
+	bool checkEps, converged, energyValid;
+	double energy, prevEnergy;
+	Mat prevMask;
+
+	// pixels frozen to a terminal, see freezeStablePixels
+	bool freeze, rebuild;
+	Mat stable;
+	int frozen;
+};
+
+GrabCutSolver::GrabCutSolver( const Mat& _img, Mat& _mask, Rect _rect, Mat& _bgdModel, Mat& _fgdModel,
+	int _iterCount, int _mode, const GrabCutParams& _params, GrabCutStats* _stats, GrabCutWorkspace* _workspace ) :
+	ownWorkspace(_workspace ? Ptr<GrabCutWorkspaceImpl>() : makePtr<GrabCutWorkspaceImpl>()),
+	workspace(_workspace ? *static_cast<GrabCutWorkspaceImpl*>(_workspace) : *ownWorkspace), fullImg(_img), fullMask(_mask), bgdModel(_bgdModel), fgdModel(_fgdModel), rect(_rect),
+	iterCount(_iterCount), mode(_mode & ~GC_ROI_ONLY), flags(_mode & GC_ROI_ONLY), params(_params), stats(_stats),
+	bgdGMM(_bgdModel), fgdGMM(_fgdModel), contextWeight(1), lambda(0), graph(workspace.graph), wideGraph(workspace.wideGraph),
+	quantGraph(workspace.quantGraph), wide(false), quantum(1), eliminated(0), reuse(false), inBand(false),
+	i(0), checkEps(false), converged(false), energyValid(false), energy(0), prevEnergy(0),
+	freeze(false), rebuild(false), frozen(0)
+{
+	if (fullImg.empty())
+		CV_Error(CV_StsBadArg, "image is empty");
+	if (fullImg.type() != CV_8UC3)
+		CV_Error(CV_StsBadArg, "image must have CV_8UC3 type");
+	if (params.connectivity != 4 && params.connectivity != 8)
+		CV_Error(CV_StsBadArg, "connectivity must be 4 or 8");
+}
+
+size_t GrabCutSolver::memoryUsage( Size size, const GrabCutParams& params )
+{
+	size_t area = (size_t)size.area(), edgeCount = 2 * (size_t)nbrPairCount(size, params.connectivity) + 2;
+	bool wideEdges = edgeCount > INT_MAX; // see needsWideGCGraph
+	// compIdxs, pxl2Vtx, lbl, stable, prevMask, tWeights, newTWeights, the n-weights and pxl2Edge,
+	// then the matrices of the band
+	size_t matSize = area * (4 * sizeof(int) + 1 + 2 * sizeof(Vec2d) + 4 * sizeof(double) +
+		4 * (wideEdges ? sizeof(int64) : sizeof(int)));
+	if (params.bandWidth > 0)
+		matSize += area * (1 + sizeof(float) + sizeof(int) + 4 * sizeof(int) + sizeof(Vec2d));
+	size_t graphSize = wideEdges ? GCGraph<double, int64>::memoryUsage(area, edgeCount) :
+		params.quantizeCapacities ? GCGraph<double, int, ushort>::memoryUsage(area, edgeCount) :
+		GCGraph<double>::memoryUsage(area, edgeCount);
+	return matSize + graphSize;
+}
+
+bool GrabCutSolver::prepare()
+{
+	if (stats)
+	{
+		stats->vtxCount.clear();
+		stats->eliminatedVtxCount.clear();
+		stats->bandOverflow.clear();
+		stats->frozenCount.clear();
+		stats->iterations = 0;
+		stats->energy = 0;
+	}
+
+	if (mode == GC_INIT_WITH_RECT)
+		initMaskWithRect(fullMask, fullImg.size(), rect);
+	else // GC_INIT_WITH_MASK or GC_EVAL
+		checkMask(fullImg, fullMask);
+
+	if (params.superpixelSize > 1 && iterCount > 0)
+	{
+		grabCut_superpixel(fullImg, fullMask, bgdModel, fgdModel, iterCount, mode, flags, params, stats, &workspace);
+		return false;
+	}
+
+	// coarse-to-fine: the downsampled image is not smaller than 16 pixels
+	int levels = params.pyramidLevels;
+	while (levels > 0 && std::min(fullImg.cols, fullImg.rows) >> levels < 16)
+		levels--;
+	if (levels > 0 && iterCount > 0)
+	{
+		grabCut_pyramid(fullImg, fullMask, bgdModel, fgdModel, iterCount, mode, flags, levels, params, stats, &workspace);
+		return false;
+	}
+
+	// with GC_ROI_ONLY, the segmentation (beta included) runs on the uncertain region only, and the GMMs are
+	// learned from the samples of sampleGMMPixels, or from the whole image and its context when given
+	Rect roi(0, 0, fullImg.cols, fullImg.rows);
+	gmmImg = fullImg;
+	gmmMask = fullMask;
+	if (flags & GC_ROI_ONLY)
+		roi = uncertainROI(fullMask);
+	if (!contextSamples.empty())
+		contextGMMPixels(fullImg, fullMask, contextSamples, contextLabels, contextWeight, gmmImg, gmmMask, gmmWeights);
+	else if (roi.area() > 0 && roi.area() < fullImg.rows*fullImg.cols)
+		sampleGMMPixels(fullImg, fullMask, roi, gmmImg, gmmMask, gmmWeights);
+
+	if (mode == GC_INIT_WITH_RECT || mode == GC_INIT_WITH_MASK)
+		initGMMs(gmmImg, gmmMask, bgdGMM, fgdGMM);
+
+	if (iterCount <= 0 || roi.area() == 0)
+		return false;
+
+	img = fullImg(roi);
+	mask = fullMask(roi);
+	compIdxs = workspace.take(workspace.compIdxs, gmmImg.size(), CV_32SC1);
+	pxl2Vtx = workspace.take(workspace.pxl2Vtx, img.size(), CV_32SC1);
+	wide = needsWideGCGraph(img.size(), params.connectivity);
+	pxl2Edge = workspace.take(workspace.pxl2Edge, img.size(), wide ? pixelEdgesType<int64>() : pixelEdgesType<int>());
+	tWeights = workspace.take(workspace.tWeights, img.size(), CV_64FC2);
+	lbl = workspace.take(workspace.lbl, img.size(), CV_32SC1);
+	newTWeights = workspace.take(workspace.newTWeights, img.size(), CV_64FC2);
+	leftW = workspace.take(workspace.leftW, img.size(), CV_64FC1);
+	upleftW = workspace.take(workspace.upleftW, img.size(), CV_64FC1);
+	upW = workspace.take(workspace.upW, img.size(), CV_64FC1);
+	uprightW = workspace.take(workspace.uprightW, img.size(), CV_64FC1);
+
+	const double gamma = 50;
+	lambda = 9 * gamma;
+	calcBetaAndNWeights(img, params.connectivity, leftW, upleftW, upW, uprightW, gamma);
+	// the n-weights are at most gamma: the residuals of an edge pair stay below 65535 units
+	quantum = gamma / 32767;
+
+	if (params.termCrit.type & TermCriteria::COUNT)
+		iterCount = std::min(iterCount, params.termCrit.maxCount);
+	checkEps = (params.termCrit.type & TermCriteria::EPS) != 0;
+
+	if (params.bandWidth > 0)
+	{
+		bandMask = workspace.take(workspace.bandMask, img.size(), CV_8UC1);
+		bandDist = workspace.take(workspace.bandDist, img.size(), CV_32FC1);
+		bandPxl2Vtx = workspace.take(workspace.bandPxl2Vtx, img.size(), CV_32SC1);
+		bandPxl2Edge = workspace.take(workspace.bandPxl2Edge, img.size(), pixelEdgesType<int>());
+		bandTWeights = workspace.take(workspace.bandTWeights, img.size(), CV_64FC2);
+	}
+
+	freeze = params.freezeIterations > 0;
+	if (checkEps || freeze)
+		prevMask = workspace.take(workspace.prevMask, img.size(), CV_8UC1);
+	if (freeze)
+	{
+		stable = workspace.take(workspace.stable, img.size(), CV_32SC1);
+		stable.setTo(Scalar::all(0));
+	}
+	return true;
+}
+
+/*
+ The graph of the first iteration is kept: the later iterations only update its capacities, and
+ reuse its residual graph and search trees when possible. It is built again after pixels were
+ frozen, the reduction then removing them.
+*/
+void GrabCutSolver::model()
+{
+	// the samples of contextGMMPixels start with the whole image, those of sampleGMMPixels with roi
+	if (gmmMask.data != fullMask.data)
+		copyROILabels(contextSamples.empty() ? mask : fullMask, gmmMask);
+	assignGMMsComponents(gmmImg, gmmMask, bgdGMM, fgdGMM, compIdxs);
+	learnGMMs(gmmImg, gmmMask, compIdxs, bgdGMM, fgdGMM, gmmWeights.empty() ? 0 : &gmmWeights);
+	if (checkEps || freeze)
+		mask.copyTo(prevMask);
+
+	if (params.connectivity == 4)
+		modelConn<4>();
+	else
+		modelConn<8>();
+}
+
+template <int Conn>
+void GrabCutSolver::modelConn()
+{
+	// after the first iteration, try to solve a narrow band around the boundary only
+	inBand = false;
+	if (i > 0 && params.bandWidth > 0)
+	{
+		int bandVtxCount, bandJoined;
+		inBand = estimateSegmentation_band<Conn>(img, mask, bgdGMM, fgdGMM, lambda, leftW, upleftW, upW, uprightW,
+			params.bandWidth, workspace.bandGraph, bandMask, bandDist, bandPxl2Vtx, bandPxl2Edge, bandTWeights,
+			bandVtxCount, bandJoined);
+		if (stats)
+		{
+			stats->bandOverflow.push_back(!inBand);
+			if (inBand)
+			{
+				stats->vtxCount.push_back(bandVtxCount);
+				stats->eliminatedVtxCount.push_back(bandJoined);
+			}
+		}
+	}
+	else if (stats)
+		stats->bandOverflow.push_back(0);
+
+	if (inBand)
+		return;
+
+	if (wide)
+		modelGraph<Conn>(wideGraph);
+	else if (params.quantizeCapacities)
+		modelGraph<Conn>(quantGraph);
+	else
+		modelGraph<Conn>(graph);
+}
+
+template <int Conn, class TIndex, class TCap>
+void GrabCutSolver::modelGraph( GCGraph<double, TIndex, TCap>& g )
+{
+	reuse = false;
+	if (i == 0 || rebuild)
+	{
+		g.clear();
+		g.setQuantum(quantum);
+		eliminated = constructGCGraph_slim<Conn>(img, mask, bgdGMM, fgdGMM, lambda, leftW, upleftW, upW, uprightW, g, pxl2Vtx, pxl2Edge, tWeights);
+		rebuild = false;
+	}
+	else
+		reuse = updateGCGraph_slim<Conn>(img, mask, bgdGMM, fgdGMM, lambda, leftW, upleftW, upW, uprightW, g, pxl2Vtx, pxl2Edge, tWeights, lbl, newTWeights, eliminated);
+
+	if (stats)
+	{
+		stats->vtxCount.push_back((int)g.vtxCount());
+		stats->eliminatedVtxCount.push_back(eliminated);
+	}
+}
+
+template <class TIndex, class TCap>
+void GrabCutSolver::solveGraph( GCGraph<double, TIndex, TCap>& g )
+{
+	if (reuse)
+	{
+		g.maxFlow(true);
+		setMask_slim(g, mask, pxl2Vtx);
+	}
+	else
+		estimateSegmentation_slim(g, mask, pxl2Vtx);
+}
+
+void GrabCutSolver::solve()
+{
+	if (!inBand)
+	{
+		if (wide)
+			solveGraph(wideGraph);
+		else if (params.quantizeCapacities)
+			solveGraph(quantGraph);
+		else
+			solveGraph(graph);
+	}
+	i++;
+	if (stats)
+	{
+		stats->iterations = i;
+		stats->frozenCount.push_back(frozen);
+	}
+
+	// the t-weights of the band iterations only cover the band
+	energyValid = false;
+	if (checkEps)
+	{
+		int prCount;
+		int changed = changedLabels(mask, prevMask, prCount);
+		energy = segmentationEnergy(img, mask, bgdGMM, fgdGMM, inBand ? 0 : &tWeights, leftW, upleftW, upW, uprightW);
+		energyValid = true;
+		converged = changed <= params.termCrit.epsilon * prCount ||
+			(i > 1 && fabs(energy - prevEnergy) <= params.termCrit.epsilon * fabs(prevEnergy));
+		prevEnergy = energy;
+		if (converged)
+			return;
+	}
+
+	// the last iteration leaves its pixels unfrozen
+	if (freeze && i < iterCount)
+	{
+		int count = freezeStablePixels(mask, prevMask, inBand ? 0 : &tWeights, stable,
+			params.freezeIterations, params.freezeMargin);
+		frozen += count;
+		rebuild = rebuild || count > 0;
+	}
+}
+
+void GrabCutSolver::finish()
+{
+	if (frozen > 0)
+	{
+		thawPixels(mask, stable);
+		energyValid = false;
+	}
+	// the t-weights of the frozen pixels are those of hard labels
+	if (stats)
+		stats->energy = energyValid ? energy :
+			segmentationEnergy(img, mask, bgdGMM, fgdGMM, inBand || frozen > 0 ? 0 : &tWeights, leftW, upleftW, upW, uprightW);
+}
+
+/*
+ Runs a grabCut call, on the buffers of workspace when it is not null.
+*/
+static void runGrabCut( const Mat& img, Mat& mask, Rect rect, Mat& bgdModel, Mat& fgdModel, int iterCount,
+	int mode, const GrabCutParams& params, GrabCutStats* stats, GrabCutWorkspace* workspace )
+{
+	GrabCutSolver solver(img, mask, rect, bgdModel, fgdModel, iterCount, mode, params, stats, workspace);
+	if (!solver.prepare())
+		return;
+	while (!solver.done())
+	{
+		solver.model();
+		solver.solve();
+	}
+	solver.finish();
+}
+
+void cv::grabCut(InputArray _img, InputOutputArray _mask, Rect rect,
+	InputOutputArray _bgdModel, InputOutputArray _fgdModel,
+	int iterCount, int mode, const GrabCutParams& params, GrabCutStats* stats)
+{
+	grabCut(_img, _mask, rect, _bgdModel, _fgdModel, iterCount, mode, params, Ptr<GrabCutWorkspace>(), stats);
+}
+
+void cv::grabCut(InputArray _img, InputOutputArray _mask, Rect rect,
+	InputOutputArray _bgdModel, InputOutputArray _fgdModel,
+	int iterCount, int mode, const GrabCutParams& params, const Ptr<GrabCutWorkspace>& workspace,
+	GrabCutStats* stats)
+{
+	runGrabCut(_img.getMat(), _mask.getMatRef(), rect, _bgdModel.getMatRef(), _fgdModel.getMatRef(),
+		iterCount, mode, params, stats, workspace.get());
+}
+
+/*
+ Images from which the per-image phases are solved region-parallel, on all the threads of the
+ pool: the smaller ones are segmented in parallel, one image per thread, which also bounds the
+ memory used by the graphs.
+*/
+static const int batchRegionParallelArea = 1 << 22;
+
+void cv::grabCutBatch( const std::vector<Mat>& imgs, std::vector<Mat>& masks, const std::vector<Rect>& rects,
+	std::vector<Mat>& bgdModels, std::vector<Mat>& fgdModels, int iterCount, int mode,
+	const GrabCutParams& params, std::vector<GrabCutStats>* stats )
+{
+	const int count = (int)imgs.size();
+	if (masks.size() != imgs.size())
+		CV_Error(CV_StsBadArg, "masks must have the size of imgs");
+	if ((mode & ~GC_ROI_ONLY) == GC_INIT_WITH_RECT && rects.size() != imgs.size())
+		CV_Error(CV_StsBadArg, "rects must have the size of imgs");
+	bgdModels.resize(count);
+	fgdModels.resize(count);
+	if (stats)
+		stats->assign(count, GrabCutStats());
+
+	std::vector<int> small, large;
+	for (int i = 0; i < count; i++)
+		(imgs[i].rows * imgs[i].cols < batchRegionParallelArea ? small : large).push_back(i);
+
+	std::function<void(int, const Ptr<GrabCutWorkspace>&)> segment = [&](int i, const Ptr<GrabCutWorkspace>& workspace)
+	{
+		grabCut(imgs[i], masks[i], rects.empty() ? Rect() : rects[i], bgdModels[i], fgdModels[i],
+			iterCount, mode, params, workspace, stats ? &(*stats)[i] : 0);
+	};
+
+	// one task per thread, which segments the small images one after another in its own workspace
+	int threads = std::min(GrabCutThreadPool::instance().threadCount(), (int)small.size());
+	std::atomic<int> next(0);
+	GrabCutThreadPool::instance().run(threads, [&](int)
+	{
+		Ptr<GrabCutWorkspace> workspace = createGrabCutWorkspace();
+		for (int k = next++; k < (int)small.size(); k = next++)
+			segment(small[k], workspace);
+	});
+
+	// the graphs of the large images benefit from huge pages
+	Ptr<GrabCutWorkspace> workspace = createGrabCutWorkspace(true);
+	for (size_t k = 0; k < large.size(); k++)
+		segment(large[k], workspace);
+}
+
+/*
+ Multithreded version of grabCut
+ Reduced graph, solved as by cv::grabCut with the default parameters
+*/
+void cv::grabCut_slim(InputArray _img, InputOutputArray _mask, Rect rect,
+	InputOutputArray _bgdModel, InputOutputArray _fgdModel,
+	int iterCount, int mode)
+{
+	grabCut_slim(_img, _mask, rect, _bgdModel, _fgdModel, iterCount, mode, 0);
+}
+
+void cv::grabCut_slim(InputArray _img, InputOutputArray _mask, Rect rect,
+	InputOutputArray _bgdModel, InputOutputArray _fgdModel,
+	int iterCount, int mode, GrabCutStats* stats)
+{
+	runGrabCut(_img.getMat(), _mask.getMatRef(), rect, _bgdModel.getMatRef(), _fgdModel.getMatRef(),
+		iterCount, mode, GrabCutParams(), stats, 0);
+}
+
+
+/*
+ Interactive GrabCut session, see cv::GrabCutSession.
+ The session keeps the reduced graph of the last segmentation with its residual flow, and the
+ order of the joins of the reduction (joinRank, see reduceGCGraph_slim). A stroke only changes
+ the t-weights of the stroked pixels: the joins which relied on a stroked pixel, directly or
+ through other joins, are not persistent any more and these pixels are released into the graph
+ (see releasePixel_slim). The max flow is then resumed with maxFlow(true).
+ The n-links are those of GrabCutParams::connectivity, the other parameters are not used.
+*/
+namespace cv
+{
+
+class GrabCutSessionImpl : public GrabCutSession
+{
+public:
+	GrabCutSessionImpl(const Mat& img, const Mat& mask, Rect rect, int mode, const GrabCutParams& params);
+
+	void run(int iterCount);
+	void applyStroke(InputArray patch, Point offset);
+	void applyStroke(const std::vector<Point>& pixels, int value);
+	void getMask(OutputArray mask) const;
+	void getModels(OutputArray bgdModel, OutputArray fgdModel) const;
+
+private:
+	void update(const std::vector<Point>& pixels, const std::vector<uchar>& values);
+	template <int Conn> void runConn(int iterCount);
+	template <int Conn> void updateConn(const std::vector<Point>& pixels, const std::vector<uchar>& values);
+	template <int Conn> void releaseDependents(Point p);
+
+	Mat img_, mask_, bgdModel_, fgdModel_;
+	int connectivity_;
+	Mat leftW_, upleftW_, upW_, uprightW_;
+	double lambda_;
+	GCGraph<double> graph_;
+	Mat pxl2Vtx_, pxl2Edge_, tWeights_, joinRank_;
+	Mat lbl_, newTWeights_; // scratch of updateGCGraph_slim
+	bool solved_;
+};
+
+GrabCutSessionImpl::GrabCutSessionImpl(const Mat& img, const Mat& mask, Rect rect, int mode, const GrabCutParams& params)
+	: img_(img), connectivity_(params.connectivity), solved_(false)
+{
+	if (img_.empty())
+		CV_Error(CV_StsBadArg, "image is empty");
+	if (img_.type() != CV_8UC3)
+		CV_Error(CV_StsBadArg, "image must have CV_8UC3 type");
+	if (connectivity_ != 4 && connectivity_ != 8)
+		CV_Error(CV_StsBadArg, "connectivity must be 4 or 8");
+
+	if (mode == GC_INIT_WITH_RECT)
+		initMaskWithRect(mask_, img_.size(), rect);
+	else if (mode == GC_INIT_WITH_MASK)
+	{
+		checkMask(img_, mask);
+		mask_ = mask.clone();
+	}
+	else
+		CV_Error(CV_StsBadArg, "mode must be GC_INIT_WITH_RECT or GC_INIT_WITH_MASK");
+
+	GMM<> bgdGMM(bgdModel_), fgdGMM(fgdModel_);
+	initGMMs(img_, mask_, bgdGMM, fgdGMM);
+
+	const double gamma = 50;
+	lambda_ = 9 * gamma;
+	calcBetaAndNWeights(img_, connectivity_, leftW_, upleftW_, upW_, uprightW_, gamma);
+}
+
+void GrabCutSessionImpl::run(int iterCount)
+{
+	if (connectivity_ == 4)
+		runConn<4>(iterCount);
+	else
+		runConn<8>(iterCount);
+}
+
+template <int Conn>
+void GrabCutSessionImpl::runConn(int iterCount)
+{
+	GMM<> bgdGMM(bgdModel_), fgdGMM(fgdModel_);
+	Mat compIdxs(img_.size(), CV_32SC1);
+	int joined;
+
+	for (int i = 0; i < iterCount; i++)
+	{
+		assignGMMsComponents(img_, mask_, bgdGMM, fgdGMM, compIdxs);
+		learnGMMs(img_, mask_, compIdxs, bgdGMM, fgdGMM);
+
+		if (!solved_)
+		{
+			pxl2Vtx_.create(img_.size(), CV_32SC1);
+			constructGCGraph_slim<Conn>(img_, mask_, bgdGMM, fgdGMM, lambda_, leftW_, upleftW_, upW_, uprightW_,
+				graph_, pxl2Vtx_, pxl2Edge_, tWeights_, &joinRank_);
+			estimateSegmentation_slim(graph_, mask_, pxl2Vtx_);
+			solved_ = true;
+		}
+		else if (updateGCGraph_slim<Conn>(img_, mask_, bgdGMM, fgdGMM, lambda_, leftW_, upleftW_, upW_, uprightW_,
+			graph_, pxl2Vtx_, pxl2Edge_, tWeights_, lbl_, newTWeights_, joined, &joinRank_))
+		{
+			graph_.maxFlow(true);
+			setMask_slim(graph_, mask_, pxl2Vtx_);
+		}
+		else
+			estimateSegmentation_slim(graph_, mask_, pxl2Vtx_);
+	}
+}
+
+static inline bool isGrabCutClass(int val)
+{
+	return val == GC_BGD || val == GC_FGD || val == GC_PR_BGD || val == GC_PR_FGD;
+}
+
+void GrabCutSessionImpl::applyStroke(InputArray _patch, Point offset)
+{
+	Mat patch = _patch.getMat();
+	if (patch.type() != CV_8UC1)
+		CV_Error(CV_StsBadArg, "patch must have CV_8UC1 type");
+	if (offset.x < 0 || offset.y < 0 || offset.x + patch.cols > img_.cols || offset.y + patch.rows > img_.rows)
+		CV_Error(CV_StsBadArg, "patch must lie inside the image");
+
+	std::vector<Point> pixels;
+	std::vector<uchar> values;
+	Point p;
+	for (p.y = 0; p.y < patch.rows; p.y++)
+	{
+		for (p.x = 0; p.x < patch.cols; p.x++)
+		{
+			uchar val = patch.at<uchar>(p);
+			if (val == 255)
+				continue;
+			if (!isGrabCutClass(val))
+				CV_Error(CV_StsBadArg, "patch element value must be equal "
+					"GC_BGD or GC_FGD or GC_PR_BGD or GC_PR_FGD or 255");
+			pixels.push_back(Point(offset.x + p.x, offset.y + p.y));
+			values.push_back(val);
+		}
+	}
+	update(pixels, values);
+}
+
+void GrabCutSessionImpl::applyStroke(const std::vector<Point>& pixels, int value)
+{
+	if (!isGrabCutClass(value))
+		CV_Error(CV_StsBadArg, "value must be equal GC_BGD or GC_FGD or GC_PR_BGD or GC_PR_FGD");
+	for (size_t i = 0; i < pixels.size(); i++)
+		if (pixels[i].x < 0 || pixels[i].x >= img_.cols || pixels[i].y < 0 || pixels[i].y >= img_.rows)
+			CV_Error(CV_StsBadArg, "pixels must lie inside the image");
+	update(pixels, std::vector<uchar>(pixels.size(), (uchar)value));
+}
+
+/*
+ Release the pixels whose join relied on the join of p, i.e. the joined neighbors of higher
+ rank, and recursively their own dependents. Their ranks are cleared, as well as the one of p.
+*/
+template <int Conn>
+void GrabCutSessionImpl::releaseDependents(Point p)
+{
+	const Mat* nW[4] = { &leftW_, &upleftW_, &upW_, &uprightW_ };
+	std::vector<std::pair<Point, int> > stack(1, std::make_pair(p, joinRank_.at<int>(p)));
+	joinRank_.at<int>(p) = -1;
+
+	while (!stack.empty())
+	{
+		Point u = stack.back().first;
+		int rank = stack.back().second;
+		stack.pop_back();
+		if (u != p && pxl2Vtx_.at<int>(u) < 0)
+			releasePixel_slim<Conn>(u, tWeights_.at<Vec2d>(u), true, nW, tWeights_, graph_, pxl2Vtx_, pxl2Edge_);
+		for (int k = 0; k < 8; k += 8 / Conn)
+		{
+			Point q(u.x + nbr_dx[k], u.y + nbr_dy[k]);
+			if (q.x < 0 || q.x >= img_.cols || q.y < 0 || q.y >= img_.rows)
+				continue;
+			int& r = joinRank_.at<int>(q);
+			if (r > rank)
+			{
+				stack.push_back(std::make_pair(q, r));
+				r = -1;
+			}
+		}
+	}
+}
+
+/*
+ Write the stroke in the mask and update the segmentation. A stroke between GC_PR_BGD and
+ GC_PR_FGD does not change the energy. When a t-weight update cannot be made by difference
+ (zero GMM probability), the graph is built again.
+*/
+void GrabCutSessionImpl::update(const std::vector<Point>& pixels, const std::vector<uchar>& values)
+{
+	if (connectivity_ == 4)
+		updateConn<4>(pixels, values);
+	else
+		updateConn<8>(pixels, values);
+}
+
+template <int Conn>
+void GrabCutSessionImpl::updateConn(const std::vector<Point>& pixels, const std::vector<uchar>& values)
+{
+	const Mat* nW[4] = { &leftW_, &upleftW_, &upW_, &uprightW_ };
+	GMM<> bgdGMM(bgdModel_), fgdGMM(fgdModel_);
+	bool dynamic = true;
+
+	for (size_t i = 0; i < pixels.size(); i++)
+	{
+		Point p = pixels[i];
+		uchar& m = mask_.at<uchar>(p);
+		uchar val = values[i];
+		bool hard = val == GC_BGD || val == GC_FGD;
+		bool same = m == val || (!hard && m != GC_BGD && m != GC_FGD);
+		m = val;
+		if (!solved_ || !dynamic || same)
+			continue;
+
+		Vec2d tw = tWeights_.at<Vec2d>(p), ntw;
+		if (hard)
+			ntw = (val == GC_BGD) ? Vec2d(0, lambda_) : Vec2d(lambda_, 0);
+		else
+		{
+			Vec3b color = img_.at<Vec3b>(p);
+			ntw = Vec2d(-log(bgdGMM(color)), -log(fgdGMM(color)));
+		}
+
+		int vtx = pxl2Vtx_.at<int>(p);
+		if (vtx >= 0)
+		{
+			dynamic = fabs(ntw[0] - tw[0]) <= DBL_MAX && fabs(ntw[1] - tw[1]) <= DBL_MAX;
+			if (!dynamic)
+				continue;
+			if (joinRank_.at<int>(p) >= 0)
+				releaseDependents<Conn>(p);
+			graph_.updateTermWeights(vtx, ntw[0] - tw[0], ntw[1] - tw[1]);
+		}
+		else if (hard && (val == GC_BGD) == jbg(vtx))
+		{
+			// the label of the join is kept, the pixel does not rely on its neighbors any more
+			graph_.sourceToSinkW += jfg(vtx) ? ntw[1] - tw[1] : ntw[0] - tw[0];
+			joinRank_.at<int>(p) = 0;
+		}
+		else
+		{
+			releaseDependents<Conn>(p);
+			releasePixel_slim<Conn>(p, ntw, true, nW, tWeights_, graph_, pxl2Vtx_, pxl2Edge_);
+		}
+		tWeights_.at<Vec2d>(p) = ntw;
+	}
+	if (!solved_)
 		return;
 
-	if (mode == GC_EVAL)
-		checkMask(img, mask);
+	if (dynamic)
+	{
+		graph_.maxFlow(true);
+		setMask_slim(graph_, mask_, pxl2Vtx_);
+	}
+	else
+	{
+		graph_.clear();
+		constructGCGraph_slim<Conn>(img_, mask_, bgdGMM, fgdGMM, lambda_, leftW_, upleftW_, upW_, uprightW_,
+			graph_, pxl2Vtx_, pxl2Edge_, tWeights_, &joinRank_);
+		estimateSegmentation_slim(graph_, mask_, pxl2Vtx_);
+	}
+}
 
-	const double gamma = 50;
-	const double lambda = 9 * gamma;
-	const double beta = calcBeta(img);
+void GrabCutSessionImpl::getMask(OutputArray mask) const
+{
+	mask_.copyTo(mask);
+}
 
-	Mat leftW, upleftW, upW, uprightW;
-	calcNWeights(img, leftW, upleftW, upW, uprightW, beta, gamma);
+void GrabCutSessionImpl::getModels(OutputArray bgdModel, OutputArray fgdModel) const
+{
+	bgdModel_.copyTo(bgdModel);
+	fgdModel_.copyTo(fgdModel);
+}
 
-	for (int i = 0; i < iterCount; i++)
+}
+
+cv::Ptr<cv::GrabCutSession> cv::createGrabCutSession(InputArray img, InputArray mask, Rect rect, int mode,
+	const GrabCutParams& params)
+{
+	return makePtr<GrabCutSessionImpl>(img.getMat(), mode == GC_INIT_WITH_MASK ? mask.getMat() : Mat(), rect, mode, params);
+}
+
+/*
+ Physical memory of the machine in bytes, 0 when unknown.
+*/
+static size_t physicalMemory()
+{
+#if defined _WIN32
+	MEMORYSTATUSEX status;
+	status.dwLength = sizeof(status);
+	if (GlobalMemoryStatusEx(&status))
+		return (size_t)status.ullTotalPhys;
+#elif defined _SC_PHYS_PAGES
+	long pages = sysconf(_SC_PHYS_PAGES), pageSize = sysconf(_SC_PAGESIZE);
+	if (pages > 0 && pageSize > 0)
+		return (size_t)pages * (size_t)pageSize;
+#endif
+	return 0;
+}
+
+/*
+ GrabCut pipeline: a model thread runs prepare and model (see GrabCutSolver), a solve thread
+ runs solve, so the model phase of an image runs while the solve phase of another one runs.
+ The images which need another iteration go back to the model thread, which serves them
+ before admitting new images.
+*/
+namespace cv
+{
+
+class GrabCutPipelineImpl : public GrabCutPipeline
+{
+public:
+	GrabCutPipelineImpl(int iterCount, const GrabCutParams& params, int queueSize, size_t memoryLimit);
+	~GrabCutPipelineImpl();
+
+	void push(InputArray img, InputArray mask, Rect rect, int mode, InputArray bgdModel, InputArray fgdModel);
+	bool pop(OutputArray mask, OutputArray bgdModel, OutputArray fgdModel, GrabCutStats* stats);
+
+private:
+	struct Task
 	{
-		GCGraph<double> graph;
-		assignGMMsComponents(img, mask, bgdGMM, fgdGMM, compIdxs);
-		learnGMMs(img, mask, compIdxs, bgdGMM, fgdGMM);
+		Mat img, mask, bgdModel, fgdModel;
+		Rect rect;
+		int mode;
+		GrabCutStats stats;
+		Ptr<GrabCutSolver> solver;
+		Ptr<GrabCutWorkspace> workspace;
+		size_t memory;
+		bool finished;
+		std::exception_ptr error;
+	};
+
+	void modelLoop();
+	void solveLoop();
+	void complete(Task* task, std::exception_ptr error);
+
+	int iterCount;
+	GrabCutParams params;
+	int queueSize;
+	size_t memoryLimit;
+
+	std::deque<Ptr<Task> > tasks; // the tasks not popped yet, in the order of push
+	std::deque<Task*> input, modelQueue, solveQueue;
+	size_t memory; // estimated memory of the tasks in progress
+	std::vector<Ptr<GrabCutWorkspace> > workspaces; // the workspaces of the completed tasks, reused by the next ones
+	bool stop;
+	std::mutex mtx;
+	std::condition_variable stageCv, inputCv, doneCv;
+	std::thread modelThread, solveThread;
+};
 
-		tStart = clock();
-		constructGCGraph(img, mask, bgdGMM, fgdGMM, lambda, leftW, upleftW, upW, uprightW, graph);
-		tEnd = clock();
-		printf("construcGCGraph: %.2fs\n", (double)(tEnd - tStart) / CLOCKS_PER_SEC);
+GrabCutPipelineImpl::GrabCutPipelineImpl(int _iterCount, const GrabCutParams& _params, int _queueSize, size_t _memoryLimit) :
+	iterCount(_iterCount), params(_params), queueSize(std::max(_queueSize, 1)), memoryLimit(_memoryLimit),
+	memory(0), stop(false)
+{
+	// half the physical memory by default, 1 GB when it is unknown
+	if (memoryLimit == 0)
+		memoryLimit = physicalMemory() / 2;
+	if (memoryLimit == 0)
+		memoryLimit = (size_t)1 << 30;
+
+	modelThread = std::thread(&GrabCutPipelineImpl::modelLoop, this);
+	solveThread = std::thread(&GrabCutPipelineImpl::solveLoop, this);
+}
 
-		tStart = clock();
-		estimateSegmentation(graph, mask);
-		tEnd = clock();
-		printf("estimateSegmentation: %.2fs\n", (double)(tEnd - tStart) / CLOCKS_PER_SEC);
+GrabCutPipelineImpl::~GrabCutPipelineImpl()
+{
+	{
+		std::lock_guard<std::mutex> lk(mtx);
+		stop = true;
 	}
+	stageCv.notify_all();
+	inputCv.notify_all();
+	modelThread.join();
+	solveThread.join();
+}
+
+void GrabCutPipelineImpl::push(InputArray img, InputArray mask, Rect rect, int mode, InputArray bgdModel, InputArray fgdModel)
+{
+	Ptr<Task> task = makePtr<Task>();
+	task->img = img.getMat();
+	if ((mode & ~GC_ROI_ONLY) != GC_INIT_WITH_RECT)
+		mask.getMat().copyTo(task->mask);
+	if (!bgdModel.empty())
+		bgdModel.getMat().copyTo(task->bgdModel);
+	if (!fgdModel.empty())
+		fgdModel.getMat().copyTo(task->fgdModel);
+	task->rect = rect;
+	task->mode = mode;
+	task->memory = GrabCutSolver::memoryUsage(task->img.size(), params);
+	task->finished = false;
+
+	std::unique_lock<std::mutex> lk(mtx);
+	inputCv.wait(lk, [this] { return stop || (int)input.size() < queueSize; });
+	tasks.push_back(task);
+	input.push_back(task.get());
+	stageCv.notify_all();
+}
+
+bool GrabCutPipelineImpl::pop(OutputArray mask, OutputArray bgdModel, OutputArray fgdModel, GrabCutStats* stats)
+{
+	std::unique_lock<std::mutex> lk(mtx);
+	if (tasks.empty())
+		return false;
+	doneCv.wait(lk, [this] { return tasks.front()->finished; });
+	Ptr<Task> task = tasks.front();
+	tasks.pop_front();
+	lk.unlock();
+
+	if (task->error)
+		std::rethrow_exception(task->error);
+	task->mask.copyTo(mask);
+	if (bgdModel.needed())
+		task->bgdModel.copyTo(bgdModel);
+	if (fgdModel.needed())
+		task->fgdModel.copyTo(fgdModel);
+	if (stats)
+		*stats = task->stats;
+	return true;
 }
 
 /*
- Multithreded version of grabCut
- Reduced graph
+ Called with the lock held, when the task is segmented or failed.
 */
-void cv::grabCut_slim(InputArray _img, InputOutputArray _mask, Rect rect,
-	InputOutputArray _bgdModel, InputOutputArray _fgdModel,
-	int iterCount, int mode)
+void GrabCutPipelineImpl::complete(Task* task, std::exception_ptr error)
 {
-	Mat img = _img.getMat();
-	Mat& mask = _mask.getMatRef();
-	Mat& bgdModel = _bgdModel.getMatRef();
-	Mat& fgdModel = _fgdModel.getMatRef();
+	task->solver.release();
+	workspaces.push_back(task->workspace);
+	task->workspace.release();
+	task->error = error;
+	task->finished = true;
+	memory -= task->memory;
+	doneCv.notify_all();
+	stageCv.notify_all();
+}
 
-	if (img.empty())
-		CV_Error(CV_StsBadArg, "image is empty");
-	if (img.type() != CV_8UC3)
-		CV_Error(CV_StsBadArg, "image must have CV_8UC3 type");
+void GrabCutPipelineImpl::modelLoop()
+{
+	std::unique_lock<std::mutex> lk(mtx);
+	for (;;)
+	{
+		// a new image enters while the memory limit holds, or when no other one is in progress
+		stageCv.wait(lk, [this] { return stop || !modelQueue.empty() ||
+			(!input.empty() && (memory == 0 || memory + input.front()->memory <= memoryLimit)); });
+		if (stop)
+			return;
+
+		Task* task;
+		bool first = modelQueue.empty();
+		if (first)
+		{
+			task = input.front();
+			input.pop_front();
+			memory += task->memory;
+			if (!workspaces.empty())
+			{
+				task->workspace = workspaces.back();
+				workspaces.pop_back();
+			}
+			else
+				task->workspace = createGrabCutWorkspace();
+			inputCv.notify_all();
+		}
+		else
+		{
+			task = modelQueue.front();
+			modelQueue.pop_front();
+		}
+		lk.unlock();
+
+		std::exception_ptr error;
+		bool iterate = true;
+		try
+		{
+			if (first)
+			{
+				task->solver = makePtr<GrabCutSolver>(task->img, task->mask, task->rect, task->bgdModel, task->fgdModel,
+					iterCount, task->mode, params, &task->stats, task->workspace.get());
+				iterate = task->solver->prepare();
+			}
+			if (iterate)
+				task->solver->model();
+		}
+		catch (...)
+		{
+			error = std::current_exception();
+		}
 
-	GMM bgdGMM(bgdModel), fgdGMM(fgdModel);
-	Mat compIdxs(img.size(), CV_32SC1);
-	//Mat pxl2Vtx(img.size(), CV_32SC1);   // pixel vertices
-	Mat pxl2Vtx(img.size(), CV_32S);
+		lk.lock();
+		if (error || !iterate)
+			complete(task, error);
+		else
+		{
+			solveQueue.push_back(task);
+			stageCv.notify_all();
+		}
+	}
+}
 
-	clock_t tStart, tEnd;
-	tStart = clock();
-	if (mode == GC_INIT_WITH_RECT || mode == GC_INIT_WITH_MASK)
+void GrabCutPipelineImpl::solveLoop()
+{
+	std::unique_lock<std::mutex> lk(mtx);
+	for (;;)
 	{
-		if (mode == GC_INIT_WITH_RECT)
-			initMaskWithRect(mask, img.size(), rect);
-		else // flag == GC_INIT_WITH_MASK
-			checkMask(img, mask);
-		initGMMs(img, mask, bgdGMM, fgdGMM);
+		stageCv.wait(lk, [this] { return stop || !solveQueue.empty(); });
+		if (stop)
+			return;
+		Task* task = solveQueue.front();
+		solveQueue.pop_front();
+		lk.unlock();
+
+		std::exception_ptr error;
+		bool done = true;
+		try
+		{
+			task->solver->solve();
+			done = task->solver->done();
+			if (done)
+				task->solver->finish();
+		}
+		catch (...)
+		{
+			error = std::current_exception();
+		}
+
+		lk.lock();
+		if (error || done)
+			complete(task, error);
+		else
+		{
+			modelQueue.push_back(task);
+			stageCv.notify_all();
+		}
 	}
+}
 
-	if (iterCount <= 0)
-		return;
+}
 
-	if (mode == GC_EVAL)
-		checkMask(img, mask);
+cv::Ptr<cv::GrabCutPipeline> cv::createGrabCutPipeline(int iterCount, const GrabCutParams& params, int queueSize, size_t memoryLimit)
+{
+	return makePtr<GrabCutPipelineImpl>(iterCount, params, queueSize, memoryLimit);
+}
 
-	const double gamma = 50;
-	const double lambda = 9 * gamma;
+void cv::GrabCutTileIO::readMask( Rect, Mat& )
+{
+	CV_Error(CV_StsNotImplemented, "readMask must be implemented in the GC_INIT_WITH_MASK mode");
+}
 
-	const double beta = calcBeta(img);
+/*
+ Tiled segmentation of grabCutTiled. The tiles are segmented in row order. A tile is written when
+ its right neighbor is done, as their seam changes both, and the seam with the tile below only
+ needs the band of rows of the mask around their common edge, which is kept for each column of
+ tiles: 2*halo full-width rows of the mask stay in memory, besides the tile being segmented.
+ The sample learned with each tile holds the pixels of a regular grid of the image, which make a
+ downsampled image. It is segmented first, and its labels are then replaced by the results of the
+ tiles written.
+*/
+namespace cv
+{
 
-	Mat leftW, upleftW, upW, uprightW, sigmaNW;
+class GrabCutMatTileIO : public GrabCutTileIO
+{
+public:
+	GrabCutMatTileIO( const Mat& _img, Mat& _mask ) : img(_img), mask(_mask) {}
+	Size size() const { return img.size(); }
+	void readImage( Rect roi, Mat& dst ) { img(roi).copyTo(dst); }
+	void readMask( Rect roi, Mat& dst ) { mask(roi).copyTo(dst); }
+	void writeMask( Rect roi, const Mat& src ) { Mat dst = mask(roi); src.copyTo(dst); }
 
-	calcNWeights(img, leftW, upleftW, upW, uprightW, beta, gamma);
+private:
+	const Mat img;
+	Mat& mask;
+};
 
-	for (int i = 0; i < iterCount; i++)
+class GrabCutTiler
+{
+public:
+	GrabCutTiler( GrabCutTileIO& io, Rect rect, int iterCount, int mode, int tileSize, int halo,
+		const GrabCutParams& params );
+	void run();
+
+private:
+	Rect tile( int i, int j ) const;
+	Rect withHalo( Rect r ) const;
+	void readImage( Rect roi, Mat& img );
+	void readMask( Rect roi, Mat& mask );
+	void sampleImage();
+	void updateSamples( Rect roi, const Mat& mask, Rect maskRect );
+	void segment( const Mat& img, Mat& mask, int iterCount, bool withContext );
+	void refineSeam( Mat& first, Rect firstRect, Mat& second, Rect secondRect, Rect strip, int seam, bool vertical );
+	void finishTile( int i, int j, const Mat& mask, Rect maskRect );
+
+	GrabCutTileIO& io;
+	Rect rect;
+	int iterCount, mode, flags, tileSize, halo;
+	GrabCutParams params;
+	Size size;
+	int tileCols, tileRows;
+
+	// context of the GMMs: pixels of the image every step rows and columns, as an image and a mask,
+	// and as single rows on the same data
+	int step;
+	Mat samples, sampleLabels, contextSamples, contextLabels;
+
+	// rows [y - halo, y + halo) of the mask of the tiles of the previous row, y being the bottom edge
+	// of their core, after the seams with their left and right neighbors
+	std::vector<Mat> bands;
+	std::vector<Rect> bandRects;
+
+	Ptr<GrabCutWorkspace> workspace;
+};
+
+GrabCutTiler::GrabCutTiler( GrabCutTileIO& _io, Rect _rect, int _iterCount, int _mode, int _tileSize, int _halo,
+	const GrabCutParams& _params ) :
+	io(_io), rect(_rect), iterCount(_iterCount), mode(_mode & ~GC_ROI_ONLY), flags(_mode & GC_ROI_ONLY),
+	tileSize(_tileSize), halo(_halo),
+	params(_params), size(_io.size()), step(1)
+{
+	if (mode != GC_INIT_WITH_RECT && mode != GC_INIT_WITH_MASK)
+		CV_Error(CV_StsBadArg, "mode must be GC_INIT_WITH_RECT or GC_INIT_WITH_MASK");
+	if (halo <= 0 || tileSize < 2 * halo)
+		CV_Error(CV_StsBadArg, "halo must be positive and tileSize not smaller than 2*halo");
+	if (size.width <= 0 || size.height <= 0)
+		CV_Error(CV_StsBadArg, "image is empty");
+	params.pyramidLevels = 0;
+	params.superpixelSize = 0;
+	tileCols = (size.width + tileSize - 1) / tileSize;
+	tileRows = (size.height + tileSize - 1) / tileSize;
+	bands.resize(tileCols);
+	bandRects.resize(tileCols);
+	workspace = createGrabCutWorkspace();
+}
+
+Rect GrabCutTiler::tile( int i, int j ) const
+{
+	return Rect(j * tileSize, i * tileSize, tileSize, tileSize) & Rect(0, 0, size.width, size.height);
+}
+
+Rect GrabCutTiler::withHalo( Rect r ) const
+{
+	return Rect(r.x - halo, r.y - halo, r.width + 2 * halo, r.height + 2 * halo) & Rect(0, 0, size.width, size.height);
+}
+
+void GrabCutTiler::readImage( Rect roi, Mat& img )
+{
+	io.readImage(roi, img);
+	if (img.type() != CV_8UC3 || img.size() != roi.size())
+		CV_Error(CV_StsBadArg, "readImage must return a CV_8UC3 matrix of the size of roi");
+}
+
+void GrabCutTiler::readMask( Rect roi, Mat& mask )
+{
+	if (mode == GC_INIT_WITH_RECT)
+	{
+		mask.create(roi.size(), CV_8UC1);
+		mask.setTo(Scalar(GC_BGD));
+		Rect r = rect & roi;
+		if (r.area() > 0)
+		{
+			Mat fgd = mask(r - roi.tl());
+			fgd.setTo(Scalar(GC_PR_FGD));
+		}
+		return;
+	}
+	io.readMask(roi, mask);
+	if (mask.type() != CV_8UC1 || mask.size() != roi.size())
+		CV_Error(CV_StsBadArg, "readMask must return a CV_8UC1 matrix of the size of roi");
+}
+
+/*
+ First pass over the tiles, which gathers the context of the GMMs, not more pixels than a tile, and
+ segments it, so that the GMMs of the first tiles are not learned from the initial labels.
+*/
+void GrabCutTiler::sampleImage()
+{
+	double maxSamples = (double)tileSize * tileSize;
+	step = std::max(1, cvCeil(std::sqrt((double)size.width * size.height / maxSamples)));
+	int sampleCols = (size.width + step - 1) / step, sampleRows = (size.height + step - 1) / step;
+	samples.create(sampleRows, sampleCols, CV_8UC3);
+	sampleLabels.create(sampleRows, sampleCols, CV_8UC1);
+
+	Mat img, mask;
+	for (int i = 0; i < tileRows; i++)
+		for (int j = 0; j < tileCols; j++)
+		{
+			Rect r = tile(i, j);
+			readImage(r, img);
+			readMask(r, mask);
+			for (int y = (r.y + step - 1) / step * step; y < r.y + r.height; y += step)
+				for (int x = (r.x + step - 1) / step * step; x < r.x + r.width; x += step)
+				{
+					samples.at<Vec3b>(y / step, x / step) = img.at<Vec3b>(y - r.y, x - r.x);
+					sampleLabels.at<uchar>(y / step, x / step) = mask.at<uchar>(y - r.y, x - r.x);
+				}
+		}
+
+	segment(samples, sampleLabels, iterCount, false);
+	contextSamples = Mat(1, sampleCols * sampleRows, CV_8UC3, samples.data);
+	contextLabels = Mat(1, sampleCols * sampleRows, CV_8UC1, sampleLabels.data);
+}
+
+/*
+ Labels of the samples of roi from mask, whose top-left corner is at maskRect.tl()
+*/
+void GrabCutTiler::updateSamples( Rect roi, const Mat& mask, Rect maskRect )
+{
+	for (int y = (roi.y + step - 1) / step * step; y < roi.y + roi.height; y += step)
+		for (int x = (roi.x + step - 1) / step * step; x < roi.x + roi.width; x += step)
+			sampleLabels.at<uchar>(y / step, x / step) = mask.at<uchar>(y - maskRect.y, x - maskRect.x);
+}
+
+/*
+ Segments img, with the context when withContext. The mask is left unchanged when it has no
+ possible pixel, or when one of the classes has no pixel to learn its GMM from.
+*/
+void GrabCutTiler::segment( const Mat& img, Mat& mask, int count, bool withContext )
+{
+	bool possible = false, classes[2] = { false, false };
+	for (int y = 0; y < mask.rows; y++)
+		for (int x = 0; x < mask.cols; x++)
+		{
+			uchar m = mask.at<uchar>(y, x);
+			possible = possible || m == GC_PR_BGD || m == GC_PR_FGD;
+			classes[m & 1] = true;
+		}
+	for (int k = 0; withContext && k < contextLabels.cols && !(classes[0] && classes[1]); k++)
+		classes[contextLabels.at<uchar>(0, k) & 1] = true;
+	if (!possible || !classes[0] || !classes[1])
+		return;
+
+	Mat bgdModel, fgdModel;
+	GrabCutSolver solver(img, mask, Rect(), bgdModel, fgdModel, count, GC_INIT_WITH_MASK | flags, params, 0,
+		workspace.get());
+	if (withContext)
+		solver.setContext(contextSamples, contextLabels, step * step);
+	if (!solver.prepare())
+		return;
+	while (!solver.done())
 	{
-		GCGraph<double> graph;
-		Mat mask2 = mask.clone();
-		assignGMMsComponents(img, mask, bgdGMM, fgdGMM, compIdxs);
-		learnGMMs(img, mask, compIdxs, bgdGMM, fgdGMM);
-		tEnd = clock();
-		printf("**************GMM model: %.2fs\n", (double)(tEnd - tStart) / CLOCKS_PER_SEC);
+		solver.model();
+		solver.solve();
+	}
+	solver.finish();
+}
+
+/*
+ Stitches the masks of two neighboring tiles along their common edge at seam (a column when
+ vertical, a row otherwise), first being the left or top one. Each pixel of strip belongs to the
+ tile on its side of the seam. The pixels on which both masks agree, and the outer edges of the strip
+ along the seam, are fixed to the class of their tile, the other ones are segmented again from the
+ label of their tile, and their new label is set in both masks.
+*/
+void GrabCutTiler::refineSeam( Mat& first, Rect firstRect, Mat& second, Rect secondRect, Rect strip,
+	int seam, bool vertical )
+{
+	strip &= firstRect & secondRect;
+	if (strip.area() == 0)
+		return;
+	Mat a = first(strip - firstRect.tl()), b = second(strip - secondRect.tl());
+	Mat mask(strip.size(), CV_8UC1);
+	bool differ = false;
+	for (int y = 0; y < strip.height; y++)
+		for (int x = 0; x < strip.width; x++)
+		{
+			uchar ma = a.at<uchar>(y, x), mb = b.at<uchar>(y, x);
+			uchar m = (vertical ? strip.x + x : strip.y + y) < seam ? ma : mb;
+			bool edge = vertical ? x == 0 || x == strip.width - 1 : y == 0 || y == strip.height - 1;
+			if ((ma & 1) != (mb & 1) && !edge)
+			{
+				mask.at<uchar>(y, x) = (uchar)(GC_PR_BGD + (m & 1));
+				differ = true;
+			}
+			else
+				mask.at<uchar>(y, x) = (uchar)(m & 1); // GC_BGD or GC_FGD
+		}
+	if (!differ)
+		return;
+
+	Mat img;
+	readImage(strip, img);
+	segment(img, mask, 1, true);
+	for (int y = 0; y < strip.height; y++)
+		for (int x = 0; x < strip.width; x++)
+		{
+			uchar m = mask.at<uchar>(y, x);
+			if (m == GC_PR_BGD || m == GC_PR_FGD)
+				a.at<uchar>(y, x) = b.at<uchar>(y, x) = m;
+		}
+}
 
+/*
+ Writes the core of tile (i, j) from mask, whose top-left corner is at maskRect.tl(), and keeps
+ its band for the seam with the tile below.
+*/
+void GrabCutTiler::finishTile( int i, int j, const Mat& mask, Rect maskRect )
+{
+	Rect r = tile(i, j);
+	io.writeMask(r, mask(r - maskRect.tl()));
+	updateSamples(r, mask, maskRect);
+	int y = r.y + r.height;
+	bandRects[j] = Rect(r.x, y - halo, r.width, 2 * halo) & maskRect;
+	mask(bandRects[j] - maskRect.tl()).copyTo(bands[j]);
+}
 
+void GrabCutTiler::run()
+{
+	Mat img, mask, left;
+	if (tileRows * tileCols == 1)
+	{
+		// the tile is the whole image, which needs no context
+		Rect r = tile(0, 0);
+		readImage(r, img);
+		readMask(r, mask);
+		segment(img, mask, iterCount, false);
+		io.writeMask(r, mask);
+		return;
+	}
 
-		tStart = clock();
-		constructGCGraph_slim(img, mask, bgdGMM, fgdGMM, lambda, leftW, upleftW, upW, uprightW, graph, pxl2Vtx);
-		tEnd = clock();
-		printf("*************construcGCGraph slim: %.2fs\n", (double)(tEnd - tStart) / CLOCKS_PER_SEC);
+	sampleImage();
 
-		double flow;
-	
-#define TEST_VERSION
-
-#ifdef TEST_VERSION
-		GCGraph<double> graph2, graph3;
-		constructGCGraph(img, mask, bgdGMM, fgdGMM, lambda, leftW, upleftW, upW, uprightW, graph2);
-		tStart = clock();
-		flow = graph2.maxFlow();
-		tEnd = clock();
-		printf("***************seq. test standard flow: %f seq maxFlow time %.2f\n", flow+graph2.sourceToSinkW, (double)(tEnd - tStart) / CLOCKS_PER_SEC);
-		constructGCGraph(img, mask, bgdGMM, fgdGMM, lambda, leftW, upleftW, upW, uprightW, graph3);
-		//Mat mask2 = mask.clone();
-		tStart = clock();
-		flow = estimateSegmentation(graph3, mask2);
-		tEnd = clock();
-		printf("**************test standard flow: %f estimateSegmentation time %.2f\n", flow+graph3.sourceToSinkW, (double)(tEnd - tStart) / CLOCKS_PER_SEC);
-		for (int i = 0; i < img.cols; i++)
-			for (int j = 0; j < img.rows; j++)
-				mask2.at<uchar>(j, i) = mask2.at<uchar>(j, i) << 2;
-#endif
+	Rect leftRect;
+	for (int i = 0; i < tileRows; i++)
+	{
+		for (int j = 0; j < tileCols; j++)
+		{
+			Rect r = tile(i, j), e = withHalo(r);
+			readImage(e, img);
+			readMask(e, mask);
+			segment(img, mask, iterCount, true);
 
-		tStart = clock();
-		flow = graph.maxFlow();
-		tEnd = clock();
-		printf("***************seq. slim flow: %f seq maxFlow slim time %.2f\n", flow+graph.sourceToSinkW, (double)(tEnd - tStart) / CLOCKS_PER_SEC);
-		GCGraph<double> graph4;
-		constructGCGraph_slim(img, mask, bgdGMM, fgdGMM, lambda, leftW, upleftW, upW, uprightW, graph4, pxl2Vtx);
-		tStart = clock();
-		flow = estimateSegmentation_slim(graph4, mask, pxl2Vtx);
-		tEnd = clock();
-		printf("**************slim flow %f estimateSegmentation slim time %.2fs\n", flow+graph4.sourceToSinkW, (double)(tEnd - tStart) / CLOCKS_PER_SEC);
-		cv::bitwise_or(mask2, mask, mask);
+			if (i > 0)
+			{
+				// the tile above is already written: write its part of the seam again
+				refineSeam(bands[j], bandRects[j], mask, e, Rect(r.x, r.y - halo, r.width, 2 * halo), r.y, false);
+				Rect above = Rect(r.x, r.y - halo, r.width, halo) & bandRects[j];
+				io.writeMask(above, bands[j](above - bandRects[j].tl()));
+			}
+			if (j > 0)
+			{
+				refineSeam(left, leftRect, mask, e, Rect(r.x - halo, r.y, 2 * halo, r.height), r.x, true);
+				finishTile(i, j - 1, left, leftRect);
+			}
+			std::swap(left, mask);
+			leftRect = e;
+		}
+		finishTile(i, tileCols - 1, left, leftRect);
 	}
-	fflush(stdout);
 }
 
+}
+
+void cv::grabCutTiled( GrabCutTileIO& io, Rect rect, int iterCount, int mode, int tileSize, int halo,
+	const GrabCutParams& params )
+{
+	GrabCutTiler tiler(io, rect, iterCount, mode, tileSize, halo, params);
+	tiler.run();
+}
+
+void cv::grabCutTiled( InputArray _img, InputOutputArray _mask, Rect rect, int iterCount, int mode,
+	int tileSize, int halo, const GrabCutParams& params )
+{
+	Mat img = _img.getMat();
+	Mat& mask = _mask.getMatRef();
+	if (img.empty())
+		CV_Error(CV_StsBadArg, "image is empty");
+	if (img.type() != CV_8UC3)
+		CV_Error(CV_StsBadArg, "image must have CV_8UC3 type");
+	if ((mode & ~GC_ROI_ONLY) == GC_INIT_WITH_RECT)
+		mask.create(img.size(), CV_8UC1);
+	else
+		checkMask(img, mask);
+	GrabCutMatTileIO io(img, mask);
+	grabCutTiled(io, rect, iterCount, mode, tileSize, halo, params);
+}
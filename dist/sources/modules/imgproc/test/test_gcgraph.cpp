@@ -0,0 +1,265 @@
+/*M///////////////////////////////////////////////////////////////////////////////////////
+//
+//  IMPORTANT: READ BEFORE DOWNLOADING, COPYING, INSTALLING OR USING.
+//
+//  By downloading, copying, installing or using the software you agree to this license.
+//  If you do not agree to this license, do not download, install,
+//  copy or use the software.
+//
+//
+//                        Intel License Agreement
+//                For Open Source Computer Vision Library
+//
+// Copyright (C) 2000, Intel Corporation, all rights reserved.
+// Third party copyrights are property of their respective owners.
+//
+// Redistribution and use in source and binary forms, with or without modification,
+// are permitted provided that the following conditions are met:
+//
+//   * Redistribution's of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//   * Redistribution's in binary form must reproduce the above copyright notice,
+//     this list of conditions and the following disclaimer in the documentation
+//     and/or other materials provided with the distribution.
+//
+//   * The name of Intel Corporation may not be used to endorse or promote products
+//     derived from this software without specific prior written permission.
+//
+// This software is provided by the copyright holders and contributors "as is" and
+// any express or implied warranties, including, but not limited to, the implied
+// warranties of merchantability and fitness for a particular purpose are disclaimed.
+// In no event shall the Intel Corporation or contributors be liable for any direct,
+// indirect, incidental, special, exemplary, or consequential damages
+// (including, but not limited to, procurement of substitute goods or services;
+// loss of use, data, or profits; or business interruption) however caused
+// and on any theory of liability, whether in contract, strict liability,
+// or tort (including negligence or otherwise) arising in any way out of
+// the use of this software, even if advised of the possibility of such damage.
+//
+//M*/
+
+#include "test_precomp.hpp"
+#include "../src/gcgraph.hpp"
+#include <thread>
+
+using namespace cv;
+using namespace std;
+
+namespace
+{
+
+/*
+ Random grid graph with 8-connected edges. The capacities are multiples of quantum, so that the
+ graphs with 16-bit capacities hold them exactly, and some of them, and some of the differences
+ between the capacities of the two edges of a pair, are past the 16-bit range (side table of
+ GCGraph).
+*/
+struct GridGraph
+{
+	struct Edge
+	{
+		int i, j;
+		double w, revw;
+	};
+
+	int cols, rows;
+	vector<Vec2d> tWeights;
+	vector<Edge> edges;
+};
+
+const double quantum = 1. / 64;
+
+static double randomCapacity( RNG& rng )
+{
+	int units = rng.uniform(0, 10) == 0 ? rng.uniform(65536, 300000) : rng.uniform(0, 3000);
+	return units * quantum;
+}
+
+static GridGraph randomGrid( RNG& rng )
+{
+	GridGraph g;
+	g.cols = rng.uniform(2, 13);
+	g.rows = rng.uniform(2, 13);
+	for (int i = 0; i < g.cols * g.rows; i++)
+		g.tWeights.push_back(Vec2d(randomCapacity(rng), randomCapacity(rng)));
+	const int dx[] = { -1, -1, 0, 1 }, dy[] = { 0, -1, -1, -1 };
+	for (int y = 0; y < g.rows; y++)
+		for (int x = 0; x < g.cols; x++)
+			for (int k = 0; k < 4; k++)
+			{
+				int qx = x + dx[k], qy = y + dy[k];
+				if (qx < 0 || qx >= g.cols || qy < 0)
+					continue;
+				GridGraph::Edge e = { y * g.cols + x, qy * g.cols + qx, randomCapacity(rng), randomCapacity(rng) };
+				// the capacity of a pair is the mean of the two capacities, in whole units
+				if ((cvRound(e.w / quantum) + cvRound(e.revw / quantum)) & 1)
+					e.revw += quantum;
+				g.edges.push_back(e);
+			}
+	return g;
+}
+
+/*
+ Builds g, with 2x2 regions of flag 0 and 3x3 ones of flag 1 for maxFlow(reg, reg_flag).
+*/
+template <class TCap>
+static void buildGraph( const GridGraph& g, GCGraph<double, int, TCap>& graph )
+{
+	graph.create(g.tWeights.size(), 2 * g.edges.size());
+	if (numeric_limits<TCap>::is_integer)
+		graph.setQuantum(quantum);
+	for (int y = 0; y < g.rows; y++)
+		for (int x = 0; x < g.cols; x++)
+		{
+			int v = graph.addVtx(y * 2 / g.rows * 2 + x * 2 / g.cols, y * 3 / g.rows * 3 + x * 3 / g.cols);
+			graph.addTermWeights(v, g.tWeights[v][0], g.tWeights[v][1]);
+		}
+	for (size_t k = 0; k < g.edges.size(); k++)
+		graph.addEdges(g.edges[k].i, g.edges[k].j, g.edges[k].w, g.edges[k].revw);
+}
+
+/*
+ Max flow of g by Edmonds-Karp, on a dense matrix of residual capacities
+*/
+static double edmondsKarp( const GridGraph& g )
+{
+	int n = (int)g.tWeights.size() + 2, s = n - 2, t = n - 1;
+	vector<double> r(n * n, 0.);
+	for (int v = 0; v < n - 2; v++)
+	{
+		r[s * n + v] += g.tWeights[v][0];
+		r[v * n + t] += g.tWeights[v][1];
+	}
+	for (size_t k = 0; k < g.edges.size(); k++)
+	{
+		r[g.edges[k].i * n + g.edges[k].j] += g.edges[k].w;
+		r[g.edges[k].j * n + g.edges[k].i] += g.edges[k].revw;
+	}
+
+	double flow = 0;
+	for (;;)
+	{
+		vector<int> parent(n, -1);
+		vector<int> queue(1, s);
+		parent[s] = s;
+		for (size_t head = 0; head < queue.size() && parent[t] < 0; head++)
+			for (int u = queue[head], v = 0; v < n; v++)
+				if (parent[v] < 0 && r[u * n + v] > 0)
+				{
+					parent[v] = u;
+					queue.push_back(v);
+				}
+		if (parent[t] < 0)
+			return flow;
+		double m = numeric_limits<double>::max();
+		for (int v = t; v != s; v = parent[v])
+			m = std::min(m, r[parent[v] * n + v]);
+		for (int v = t; v != s; v = parent[v])
+		{
+			r[parent[v] * n + v] -= m;
+			r[v * n + parent[v]] += m;
+		}
+		flow += m;
+	}
+}
+
+/*
+ Capacity of the cut between the vertices in the source segment of graph and the other ones
+*/
+template <class TCap>
+static double cutCapacity( const GridGraph& g, GCGraph<double, int, TCap>& graph )
+{
+	double cut = 0;
+	for (int v = 0; v < (int)g.tWeights.size(); v++)
+		cut += graph.inSourceSegment(v) ? g.tWeights[v][1] : g.tWeights[v][0];
+	for (size_t k = 0; k < g.edges.size(); k++)
+	{
+		bool si = graph.inSourceSegment(g.edges[k].i), sj = graph.inSourceSegment(g.edges[k].j);
+		if (si && !sj)
+			cut += g.edges[k].w;
+		else if (sj && !si)
+			cut += g.edges[k].revw;
+	}
+	return cut;
+}
+
+template <class TCap>
+static void regionsMaxFlow( GCGraph<double, int, TCap>& graph )
+{
+	graph.finalize();
+	const int regionCounts[] = { 4, 9 };
+	for (int f = 0; f < 2; f++)
+	{
+		vector<thread> threads;
+		for (int reg = 0; reg < regionCounts[f]; reg++)
+			threads.push_back(thread([&graph, reg, f] { graph.maxFlow(reg, f); }));
+		for (size_t k = 0; k < threads.size(); k++)
+			threads[k].join();
+	}
+}
+
+/*
+ Solves a random grid cold, region-parallel, then warm-started after increasing the t-weights of
+ some vertices, checking the flows against Edmonds-Karp and the cuts against the flows.
+*/
+template <class TCap>
+static void testMaxFlow( RNG& rng )
+{
+	GridGraph g = randomGrid(rng);
+	double expected = edmondsKarp(g), eps = 1e-9 * (1 + expected);
+
+	GCGraph<double, int, TCap> cold;
+	buildGraph(g, cold);
+	double flow = cold.maxFlow();
+	ASSERT_NEAR(expected, flow, eps);
+	ASSERT_NEAR(flow, cutCapacity(g, cold), eps);
+
+	GCGraph<double, int, TCap> graph;
+	buildGraph(g, graph);
+	regionsMaxFlow(graph);
+	flow = graph.maxFlow();
+	ASSERT_NEAR(expected, flow, eps);
+	ASSERT_NEAR(flow, cutCapacity(g, graph), eps);
+
+	for (int round = 0; round < 3; round++)
+	{
+		for (int v = 0; v < (int)g.tWeights.size(); v++)
+		{
+			if (rng.uniform(0, 4) != 0)
+				continue;
+			Vec2d d(randomCapacity(rng), randomCapacity(rng));
+			g.tWeights[v] += d;
+			graph.updateTermWeights(v, d[0], d[1]);
+		}
+		expected = edmondsKarp(g);
+		eps = 1e-9 * (1 + expected);
+		flow = graph.maxFlow(true);
+		ASSERT_NEAR(expected, flow, eps);
+		ASSERT_NEAR(flow, cutCapacity(g, graph), eps);
+	}
+}
+
+}
+
+TEST(Imgproc_GCGraph, maxFlow)
+{
+	RNG rng(0x1234);
+	for (int iter = 0; iter < 200; iter++)
+	{
+		testMaxFlow<double>(rng);
+		if (HasFatalFailure())
+			return;
+	}
+}
+
+TEST(Imgproc_GCGraph, maxFlow_quantized)
+{
+	RNG rng(0x1234);
+	for (int iter = 0; iter < 200; iter++)
+	{
+		testMaxFlow<ushort>(rng);
+		if (HasFatalFailure())
+			return;
+	}
+}
@@ -0,0 +1,154 @@
+/*M///////////////////////////////////////////////////////////////////////////////////////
+//
+//  IMPORTANT: READ BEFORE DOWNLOADING, COPYING, INSTALLING OR USING.
+//
+//  By downloading, copying, installing or using the software you agree to this license.
+//  If you do not agree to this license, do not download, install,
+//  copy or use the software.
+//
+//
+//                        Intel License Agreement
+//                For Open Source Computer Vision Library
+//
+// Copyright (C) 2000, Intel Corporation, all rights reserved.
+// Third party copyrights are property of their respective owners.
+//
+// Redistribution and use in source and binary forms, with or without modification,
+// are permitted provided that the following conditions are met:
+//
+//   * Redistribution's of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//   * Redistribution's in binary form must reproduce the above copyright notice,
+//     this list of conditions and the following disclaimer in the documentation
+//     and/or other materials provided with the distribution.
+//
+//   * The name of Intel Corporation may not be used to endorse or promote products
+//     derived from this software without specific prior written permission.
+//
+// This software is provided by the copyright holders and contributors "as is" and
+// any express or implied warranties, including, but not limited to, the implied
+// warranties of merchantability and fitness for a particular purpose are disclaimed.
+// In no event shall the Intel Corporation or contributors be liable for any direct,
+// indirect, incidental, special, exemplary, or consequential damages
+// (including, but not limited to, procurement of substitute goods or services;
+// loss of use, data, or profits; or business interruption) however caused
+// and on any theory of liability, whether in contract, strict liability,
+// or tort (including negligence or otherwise) arising in any way out of
+// the use of this software, even if advised of the possibility of such damage.
+//
+//M*/
+
+#include "test_precomp.hpp"
+
+using namespace cv;
+using namespace std;
+
+namespace
+{
+
+/*
+ Noisy image of an elliptic foreground on a uniform background
+*/
+static Mat ellipseImage( int cols, int rows, RNG& rng )
+{
+	Mat img(rows, cols, CV_8UC3);
+	for (int y = 0; y < rows; y++)
+		for (int x = 0; x < cols; x++)
+		{
+			double dx = (x - cols * 0.5) / (cols * 0.25), dy = (y - rows * 0.5) / (rows * 0.3);
+			Vec3b c = dx * dx + dy * dy < 1 ? Vec3b(40, 60, 200) : Vec3b(180, 170, 60);
+			for (int k = 0; k < 3; k++)
+				c[k] = saturate_cast<uchar>(c[k] + rng.uniform(-40, 40));
+			img.at<Vec3b>(y, x) = c;
+		}
+	return img;
+}
+
+static bool sameMat( const Mat& a, const Mat& b )
+{
+	if (a.size() != b.size() || a.type() != b.type())
+		return false;
+	for (int y = 0; y < a.rows; y++)
+		if (memcmp(a.ptr(y), b.ptr(y), a.cols * a.elemSize()) != 0)
+			return false;
+	return true;
+}
+
+/*
+ Segments images of different sizes through a pipeline with an input queue of two images, and
+ checks the masks, models and statistics against sequential grabCut calls with the same
+ parameters.
+*/
+static void testPipeline( const GrabCutParams& params, size_t memoryLimit )
+{
+	const int count = 5, iterCount = 3;
+	RNG rng(0x2a);
+	vector<Mat> imgs;
+	vector<Rect> rects;
+	for (int i = 0; i < count; i++)
+	{
+		int cols = 120 + 24 * i, rows = 90 + 16 * i;
+		imgs.push_back(ellipseImage(cols, rows, rng));
+		rects.push_back(Rect(cols / 8, rows / 8, cols * 3 / 4, rows * 3 / 4));
+	}
+
+	Ptr<GrabCutPipeline> pipeline = createGrabCutPipeline(iterCount, params, 2, memoryLimit);
+	int popped = 0;
+	for (int i = 0; i < count + 2; i++)
+	{
+		// the results are popped two images behind the pushes, then the pipeline is drained
+		if (i < count)
+			pipeline->push(imgs[i], noArray(), rects[i], GC_INIT_WITH_RECT);
+		Mat mask, bgdModel, fgdModel;
+		GrabCutStats stats;
+		while (i >= 2 && popped <= i - 2 && pipeline->pop(mask, bgdModel, fgdModel, &stats))
+		{
+			Mat expMask, expBgdModel, expFgdModel;
+			GrabCutStats expStats;
+			grabCut(imgs[popped], expMask, rects[popped], expBgdModel, expFgdModel, iterCount, GC_INIT_WITH_RECT,
+				params, &expStats);
+			ASSERT_TRUE(sameMat(expMask, mask)) << "image " << popped;
+			ASSERT_TRUE(sameMat(expBgdModel, bgdModel)) << "image " << popped;
+			ASSERT_TRUE(sameMat(expFgdModel, fgdModel)) << "image " << popped;
+			ASSERT_EQ(expStats.iterations, stats.iterations);
+			ASSERT_EQ(expStats.vtxCount, stats.vtxCount);
+			ASSERT_EQ(expStats.energy, stats.energy);
+			popped++;
+		}
+	}
+	ASSERT_EQ(count, popped);
+
+	// continuation of the first image with GC_EVAL
+	Mat mask, bgdModel, fgdModel;
+	grabCut(imgs[0], mask, rects[0], bgdModel, fgdModel, 1, GC_INIT_WITH_RECT, params);
+	Mat expMask = mask.clone(), expBgdModel = bgdModel.clone(), expFgdModel = fgdModel.clone();
+	grabCut(imgs[0], expMask, rects[0], expBgdModel, expFgdModel, iterCount, GC_EVAL, params);
+	pipeline->push(imgs[0], mask, rects[0], GC_EVAL, bgdModel, fgdModel);
+	Mat evalMask;
+	ASSERT_TRUE(pipeline->pop(evalMask));
+	ASSERT_TRUE(sameMat(expMask, evalMask));
+	ASSERT_FALSE(pipeline->pop(evalMask));
+}
+
+}
+
+TEST(Imgproc_GrabCut, pipeline_sequential)
+{
+	testPipeline(GrabCutParams(), 0);
+}
+
+TEST(Imgproc_GrabCut, pipeline_sequential_oneInProgress)
+{
+	// a limit below the memory of any image keeps a single image in progress
+	testPipeline(GrabCutParams(), 1);
+}
+
+TEST(Imgproc_GrabCut, pipeline_sequential_params)
+{
+	GrabCutParams params;
+	params.bandWidth = 8;
+	params.connectivity = 4;
+	params.termCrit = TermCriteria(TermCriteria::EPS, 0, 1e-3);
+	testPipeline(params, 0);
+}